@@ -26,17 +26,40 @@ See libzpaq.h for additional documentation.
 #include <string.h>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <stdio.h>
 
 #ifdef unix
-#ifndef NOJIT
+#include <pthread.h>
 #include <sys/mman.h>
-#endif
 #else
 #include <windows.h>
 #include <wincrypt.h>
 #endif
 
+// Compile x86 SIMD code for use when the processor supports it,
+// as tested by cpuFeatures(). This is independent of NOJIT.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define X86SIMD
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+// With NOJIT, run ZPAQL as direct threaded code where the compiler
+// supports computed goto (labels as values)
+#if defined(NOJIT) && defined(__GNUC__)
+#define THREADED
+#endif
+
+// Inline even when large, as the component code in specialized predictors
+#if defined(__GNUC__)
+#define FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline
+#endif
+
 namespace libzpaq {
 
 // Read 16 bit little-endian number
@@ -57,6 +80,79 @@ void Writer::write(const char* buf, int n) {
     put(U8(buf[i]));
 }
 
+///////////////////////// allocArray //////////////////////
+
+// Huge page mode set by setHugePages()
+static int hugePages=0;
+
+void setHugePages(int mode) {
+  hugePages=mode;
+}
+
+// Allocate n > 0 bytes of zeroed memory for an Array on a 64 byte
+// boundary and set offset for freeArray(). If huge pages are enabled and
+// n is at least HUGEPAGE, then map whole huge pages and set offset=0.
+// Return 0 if out of memory.
+void* allocArray(size_t n, int& offset) {
+  if (hugePages>0 && n>=HUGEPAGE && n+HUGEPAGE>n) {
+    const size_t len=(n+HUGEPAGE-1)&~size_t(HUGEPAGE-1);
+#ifdef unix
+    char* p=(char*)MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (hugePages>=2)  // reserved hugetlb pages, if any
+      p=(char*)mmap(0, len, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+#endif
+    if (p==(char*)MAP_FAILED) {  // map 1 extra page to align the start
+      p=(char*)mmap(0, len+HUGEPAGE, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANON, -1, 0);
+      if (p!=(char*)MAP_FAILED) {
+        const size_t skip=(HUGEPAGE-(size_t(p)&(HUGEPAGE-1)))&(HUGEPAGE-1);
+        if (skip) munmap(p, skip);
+        munmap(p+skip+len, HUGEPAGE-skip);
+        p+=skip;
+#ifdef MADV_HUGEPAGE
+        madvise(p, len, MADV_HUGEPAGE);  // transparent huge pages
+#endif
+      }
+    }
+    if (p!=(char*)MAP_FAILED) {
+      offset=0;
+      return p;
+    }
+#else // Windows: large pages need the Lock Pages in Memory privilege
+    if (hugePages>=2 && GetLargePageMinimum()==HUGEPAGE) {
+      void* p=VirtualAlloc(0, len, MEM_RESERVE|MEM_COMMIT|MEM_LARGE_PAGES,
+                           PAGE_READWRITE);
+      if (p) {
+        offset=0;
+        return p;
+      }
+    }
+#endif
+  }
+  char* p=(char*)calloc(n+128, 1);
+  if (!p) return 0;
+  offset=64-(((char*)p-(char*)0)&63);
+  assert(offset>0 && offset<=64);
+  return p+offset;
+}
+
+// Free memory of n bytes from allocArray()
+void freeArray(void* p, size_t n, int offset) {
+  assert(p);
+  assert(offset>=0 && offset<=64);
+  if (offset>0)
+    ::free((char*)p-offset);
+  else {
+#ifdef unix
+    munmap(p, (n+HUGEPAGE-1)&~size_t(HUGEPAGE-1));
+#else
+    VirtualFree(p, 0, MEM_RELEASE);
+#endif
+  }
+}
+
 ///////////////////////// allocx //////////////////////
 
 // Allocate newsize > 0 bytes of executable memory and update
@@ -98,10 +194,232 @@ void allocx(U8* &p, int &n, int newsize) {
 #endif
 }
 
+///////////////////////// runThreads //////////////////////
+
+// Argument to a thread started by runThreads()
+struct ThreadArg {
+  void (*f)(void*, int);
+  void* arg;
+  int i;
+};
+
+#ifdef unix
+static void* threadMain(void* p) {
+  ThreadArg& ta=*(ThreadArg*)p;
+  ta.f(ta.arg, ta.i);
+  return 0;
+}
+#else
+static DWORD WINAPI threadMain(LPVOID p) {
+  ThreadArg& ta=*(ThreadArg*)p;
+  ta.f(ta.arg, ta.i);
+  return 0;
+}
+#endif
+
+// Call f(arg, i) for i = 0..n-1 in parallel and return when all are
+// done. f(arg, n-1) runs in the calling thread. If a thread cannot be
+// created then its call runs in the calling thread instead.
+static void runThreads(void (*f)(void*, int), void* arg, int n) {
+  std::vector<ThreadArg> ta(n>0 ? n : 1);
+#ifdef unix
+  std::vector<pthread_t> tid(ta.size());
+#else
+  std::vector<HANDLE> tid(ta.size());
+#endif
+  std::vector<bool> started(ta.size());
+  for (int i=0; i<n; ++i) {
+    ta[i].f=f;
+    ta[i].arg=arg;
+    ta[i].i=i;
+    if (i==n-1) break;
+#ifdef unix
+    started[i]=pthread_create(&tid[i], NULL, threadMain, &ta[i])==0;
+#else
+    tid[i]=CreateThread(NULL, 0, threadMain, &ta[i], 0, NULL);
+    started[i]=tid[i]!=NULL;
+#endif
+    if (!started[i]) f(arg, i);
+  }
+  if (n>0) f(arg, n-1);
+  for (int i=0; i<n-1; ++i) {
+    if (!started[i]) continue;
+#ifdef unix
+    pthread_join(tid[i], NULL);
+#else
+    WaitForSingleObject(tid[i], INFINITE);
+    CloseHandle(tid[i]);
+#endif
+  }
+}
+
+///////////////////////// cpuFeatures //////////////////////
+
+// Processor features tested at run time
+enum {CPU_SHA=1, CPU_AVX2=2, CPU_AES=4, CPU_VAES=8};
+
+// Return the CPU_* features supported by the processor and OS
+#ifdef X86SIMD
+static int testCpuFeatures() {
+  unsigned a=0, b=0, c=0, d=0;
+  int r=0;
+  if (__get_cpuid_max(0, 0)<7) return 0;
+  __cpuid_count(1, 0, a, b, c, d);
+  const bool ssse3=(c>>9)&1, sse41=(c>>19)&1, aes=(c>>25)&1,
+      osxsave=(c>>27)&1, avx=(c>>28)&1;
+  unsigned xcr0=0;
+  if (osxsave) {
+    unsigned hi;
+    __asm__("xgetbv" : "=a"(xcr0), "=d"(hi) : "c"(0));
+  }
+  __cpuid_count(7, 0, a, b, c, d);
+  if (sse41 && ((b>>29)&1)) r|=CPU_SHA;
+  if (avx && (xcr0&6)==6 && ((b>>5)&1)) r|=CPU_AVX2;
+  if (ssse3 && aes) r|=CPU_AES;
+  if ((r&CPU_AVX2) && (r&CPU_AES) && ((c>>9)&1)) r|=CPU_VAES;
+  return r;
+}
+
+static int cpuFeatures() {
+  static const int features=testCpuFeatures();
+  return features;
+}
+#endif
+
 //////////////////////////// SHA1 ////////////////////////////
 
 // SHA1 code, see http://en.wikipedia.org/wiki/SHA-1
 
+#ifdef X86SIMD
+
+// Hash n blocks of 64 bytes at p into h[0..4] using SHA instructions.
+// If words is true then p points to 16 U32 words in machine order,
+// else to bytes in big-endian order. Each group g of 4 rounds uses
+// message words m0 while computing words for later groups in m1..m3.
+__attribute__((target("sha,sse4.1")))
+static void sha1ProcessNI(U32* h, const void* p, int64_t n, bool words) {
+  const __m128i mask=words
+      ? _mm_set_epi64x(0x0302010007060504LL, 0x0b0a09080f0e0d0cLL)
+      : _mm_set_epi64x(0x0001020304050607LL, 0x08090a0b0c0d0e0fLL);
+  const __m128i* q=(const __m128i*)p;
+  __m128i abcd=_mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)h), 0x1b);
+  __m128i e0=_mm_set_epi32(h[4], 0, 0, 0), e1;
+  for (; n>0; --n, q+=4) {
+    const __m128i abcd0=abcd, e00=e0;
+    __m128i m0=_mm_shuffle_epi8(_mm_loadu_si128(q), mask);
+    __m128i m1=_mm_shuffle_epi8(_mm_loadu_si128(q+1), mask);
+    __m128i m2=_mm_shuffle_epi8(_mm_loadu_si128(q+2), mask);
+    __m128i m3=_mm_shuffle_epi8(_mm_loadu_si128(q+3), mask);
+    #define f(g,e0,e1,m0,m1,m2,m3) \
+      e0=(g) ? _mm_sha1nexte_epu32(e0, m0) : _mm_add_epi32(e0, m0); \
+      e1=abcd; \
+      if ((g)>=3 && (g)<=18) m1=_mm_sha1msg2_epu32(m1, m0); \
+      abcd=_mm_sha1rnds4_epu32(abcd, e0, (g)/5); \
+      if ((g)>=1 && (g)<=16) m3=_mm_sha1msg1_epu32(m3, m0); \
+      if ((g)>=2 && (g)<=17) m2=_mm_xor_si128(m2, m0);
+    #define r(g) f(g,e0,e1,m0,m1,m2,m3) f(g+1,e1,e0,m1,m2,m3,m0) \
+                 f(g+2,e0,e1,m2,m3,m0,m1) f(g+3,e1,e0,m3,m0,m1,m2)
+    r(0) r(4) r(8) r(12) r(16)
+    #undef f
+    #undef r
+    e0=_mm_sha1nexte_epu32(e0, e00);
+    abcd=_mm_add_epi32(abcd, abcd0);
+  }
+  _mm_storeu_si128((__m128i*)h, _mm_shuffle_epi32(abcd, 0x1b));
+  h[4]=_mm_extract_epi32(e0, 3);
+}
+
+// Hash 1 block in each of 8 lanes of w[0..15] into h[0..4]
+__attribute__((target("avx2")))
+static void sha1Process8(__m256i* h, __m256i* w) {
+  __m256i a=h[0], b=h[1], c=h[2], d=h[3], e=h[4];
+  #define rol(x,n) \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32-(n)))
+  #define f(a,b,c,d,e,i) \
+    if (i>=16) \
+      w[(i)&15]=rol(_mm256_xor_si256(_mm256_xor_si256(w[(i)&15], \
+          w[(i-3)&15]), _mm256_xor_si256(w[(i-8)&15], w[(i-14)&15])), 1); \
+    e=_mm256_add_epi32(_mm256_add_epi32(e, rol(a, 5)), \
+      _mm256_add_epi32(_mm256_add_epi32(_mm256_set1_epi32( \
+      (i)<20 ? 0x5A827999 : (i)<40 ? 0x6ED9EBA1 : (i)<60 ? 0x8F1BBCDC \
+      : 0xCA62C1D6), w[(i)&15]), \
+      (i)%40>=20 ? _mm256_xor_si256(b, _mm256_xor_si256(c, d)) \
+      : i>=40 ? _mm256_or_si256(_mm256_and_si256(b, c), \
+                _mm256_and_si256(d, _mm256_or_si256(b, c))) \
+      : _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d))))); \
+    b=rol(b, 30);
+  #define r(i) f(a,b,c,d,e,i) f(e,a,b,c,d,i+1) f(d,e,a,b,c,i+2) \
+               f(c,d,e,a,b,i+3) f(b,c,d,e,a,i+4)
+  r(0)  r(5)  r(10) r(15) r(20) r(25) r(30) r(35)
+  r(40) r(45) r(50) r(55) r(60) r(65) r(70) r(75)
+  #undef f
+  #undef r
+  #undef rol
+  h[0]=_mm256_add_epi32(h[0], a);
+  h[1]=_mm256_add_epi32(h[1], b);
+  h[2]=_mm256_add_epi32(h[2], c);
+  h[3]=_mm256_add_epi32(h[3], d);
+  h[4]=_mm256_add_epi32(h[4], e);
+}
+
+// Hash up to 8 buffers in parallel. Lanes that run out of blocks
+// before the others keep their state.
+__attribute__((target("avx2")))
+static void sha1Multi8(int n, const char* const* buf, const int64_t* len,
+                       char* result) {
+  assert(n>0 && n<=8);
+  const unsigned char* p[8];  // full blocks
+  int64_t full[8]={0}, nb[8]={0};  // number of full, total blocks
+  unsigned char tail[8][128];  // last 1 or 2 blocks with padding
+  int64_t maxnb=0;
+  for (int i=0; i<n; ++i) {
+    p[i]=(const unsigned char*)buf[i];
+    full[i]=len[i]/64;
+    nb[i]=(len[i]+8)/64+1;
+    if (nb[i]>maxnb) maxnb=nb[i];
+    const int r=len[i]&63;
+    memset(tail[i], 0, 128);
+    if (r) memcpy(tail[i], p[i]+full[i]*64, r);
+    tail[i][r]=0x80;
+    const U64 bits=U64(len[i])*8;
+    unsigned char* q=tail[i]+(nb[i]-full[i])*64-8;
+    for (int j=0; j<8; ++j) q[j]=bits>>(56-j*8);
+  }
+  alignas(32) U32 h[5][8];
+  static const U32 iv[5]={
+    0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  __m256i hv[5], w[16];
+  for (int j=0; j<5; ++j) hv[j]=_mm256_set1_epi32(iv[j]);
+  for (int64_t k=0; k<maxnb; ++k) {
+    alignas(32) U32 wb[16][8]={{0}};
+    alignas(32) int active[8]={0};
+    for (int i=0; i<n; ++i) {
+      if (k>=nb[i]) continue;
+      active[i]=-1;
+      const unsigned char* b=k<full[i] ? p[i]+k*64 : tail[i]+(k-full[i])*64;
+      for (int j=0; j<16; ++j, b+=4)
+        wb[j][i]=U32(b[0])<<24|b[1]<<16|b[2]<<8|b[3];
+    }
+    for (int j=0; j<16; ++j) w[j]=_mm256_load_si256((const __m256i*)wb[j]);
+    __m256i hn[5];
+    for (int j=0; j<5; ++j) hn[j]=hv[j];
+    sha1Process8(hn, w);
+    const __m256i mask=_mm256_load_si256((const __m256i*)active);
+    for (int j=0; j<5; ++j) hv[j]=_mm256_blendv_epi8(hv[j], hn[j], mask);
+  }
+  for (int j=0; j<5; ++j) _mm256_store_si256((__m256i*)h[j], hv[j]);
+  for (int i=0; i<n; ++i) {
+    for (int j=0; j<5; ++j) {
+      result[20*i+4*j]=h[j][i]>>24;
+      result[20*i+4*j+1]=h[j][i]>>16;
+      result[20*i+4*j+2]=h[j][i]>>8;
+      result[20*i+4*j+3]=h[j][i];
+    }
+  }
+}
+
+#endif // X86SIMD
+
 // Start a new hash
 void SHA1::init() {
   len=0;
@@ -147,6 +465,14 @@ const char* SHA1::result() {
 void SHA1::write(const char* buf, int64_t n) {
   const unsigned char* p=(const unsigned char*) buf;
   for (; n>0 && (U32(len)&511)!=0; --n) put(*p++);
+#ifdef X86SIMD
+  if (n>=64 && (cpuFeatures()&CPU_SHA)) {
+    sha1ProcessNI(h, p, n/64, false);
+    len+=U64(n/64)*512;
+    p+=n&-64;
+    n&=63;
+  }
+#endif
   for (; n>=64; n-=64) {
     for (int i=0; i<16; ++i)
       w[i]=p[0]<<24|p[1]<<16|p[2]<<8|p[3], p+=4;
@@ -156,8 +482,53 @@ void SHA1::write(const char* buf, int64_t n) {
   for (; n>0; --n) put(*p++);
 }
 
+// Compare buffer indexes by length
+struct LessLength {
+  const int64_t* len;
+  LessLength(const int64_t* l): len(l) {}
+  bool operator()(int a, int b) const {return len[a]<len[b];}
+};
+
+// Hash buf[i][0..len[i]-1] to result[20*i..20*i+19] for i=0..n-1
+void sha1Multi(int n, const char* const* buf, const int64_t* len,
+               char* result) {
+  int i=0;
+  std::vector<int> order(n);  // buffers sorted by length
+  for (int j=0; j<n; ++j) order[j]=j;
+#ifdef X86SIMD
+
+  // SHA instructions on 1 buffer beat AVX2 on 8. Otherwise hash buffers
+  // of similar length together so that few lanes are idle.
+  const int f=cpuFeatures();
+  if ((f&CPU_AVX2) && !(f&CPU_SHA) && n>=4) {
+    std::sort(order.begin(), order.end(), LessLength(len));
+    for (; n-i>=4; i+=8) {
+      const int m=n-i<8 ? n-i : 8;
+      const char* b[8];
+      int64_t l[8];
+      char r[160];
+      for (int j=0; j<m; ++j) b[j]=buf[order[i+j]], l[j]=len[order[i+j]];
+      sha1Multi8(m, b, l, r);
+      for (int j=0; j<m; ++j) memcpy(result+20*order[i+j], r+20*j, 20);
+    }
+  }
+#endif
+  SHA1 sha1;
+  for (; i<n; ++i) {
+    const int j=order[i];
+    sha1.write(buf[j], len[j]);
+    memcpy(result+20*j, sha1.result(), 20);
+  }
+}
+
 // Hash 1 block of 64 bytes
 void SHA1::process() {
+#ifdef X86SIMD
+  if (cpuFeatures()&CPU_SHA) {
+    sha1ProcessNI(h, w, 1, true);
+    return;
+  }
+#endif
   U32 a=h[0], b=h[1], c=h[2], d=h[3], e=h[4];
   static const U32 k[4]={0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6};
   #define f(a,b,c,d,e,i) \
@@ -550,9 +921,119 @@ void AES_CTR::encrypt(U32 s0, U32 s1, U32 s2, U32 s3, unsigned char* ct) {
   STORE32H(s3, ct+12);
 }
 
+#ifdef X86SIMD
+
+// Load the Nr+1 round keys of ek[] into rk[] in byte order for AES-NI
+__attribute__((target("aes,ssse3")))
+static inline void aesniKeys(const U32* ek, int Nr, __m128i* rk) {
+  const __m128i bswap32=_mm_set_epi8(12,13,14,15,8,9,10,11,4,5,6,7,0,1,2,3);
+  for (int r=0; r<=Nr; ++r)
+    rk[r]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(ek+r*4)),
+                           bswap32);
+}
+
+// Return the CTR mode input block for iv and block number i
+__attribute__((target("aes,ssse3")))
+static inline __m128i aesniCounter(U64 iv, U64 i) {
+  const __m128i rev=_mm_set_epi8(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  return _mm_shuffle_epi8(_mm_set_epi64x(iv, i), rev);
+}
+
+// AES_CTR::encrypt(buf, n, offset) using AES-NI, 8 blocks at a time
+__attribute__((target("aes,ssse3")))
+static void aesniCtr(const U32* ek, int Nr, U64 iv,
+                     char* buf, int n, U64 offset) {
+  __m128i rk[15];
+  aesniKeys(ek, Nr, rk);
+  U64 i=offset/16;
+  int p=0;  // bytes of buf done
+  unsigned char ct[16];
+
+  // Partial first block
+  if (offset%16 && n>0) {
+    __m128i x=_mm_xor_si128(aesniCounter(iv, i++), rk[0]);
+    for (int r=1; r<Nr; ++r) x=_mm_aesenc_si128(x, rk[r]);
+    _mm_storeu_si128((__m128i*)ct, _mm_aesenclast_si128(x, rk[Nr]));
+    for (int j=offset%16; j<16 && p<n; ++j) buf[p++]^=ct[j];
+  }
+
+  // Whole blocks
+  for (; p+128<=n; p+=128, i+=8) {
+    __m128i x[8];
+    for (int j=0; j<8; ++j) x[j]=_mm_xor_si128(aesniCounter(iv, i+j), rk[0]);
+    for (int r=1; r<Nr; ++r)
+      for (int j=0; j<8; ++j) x[j]=_mm_aesenc_si128(x[j], rk[r]);
+    for (int j=0; j<8; ++j) {
+      __m128i* q=(__m128i*)(buf+p+j*16);
+      _mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q),
+                                        _mm_aesenclast_si128(x[j], rk[Nr])));
+    }
+  }
+  for (; p+16<=n; p+=16, ++i) {
+    __m128i x=_mm_xor_si128(aesniCounter(iv, i), rk[0]);
+    for (int r=1; r<Nr; ++r) x=_mm_aesenc_si128(x, rk[r]);
+    __m128i* q=(__m128i*)(buf+p);
+    _mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q),
+                                      _mm_aesenclast_si128(x, rk[Nr])));
+  }
+
+  // Partial last block
+  if (p<n) {
+    __m128i x=_mm_xor_si128(aesniCounter(iv, i), rk[0]);
+    for (int r=1; r<Nr; ++r) x=_mm_aesenc_si128(x, rk[r]);
+    _mm_storeu_si128((__m128i*)ct, _mm_aesenclast_si128(x, rk[Nr]));
+    for (int j=0; p<n; ++j) buf[p++]^=ct[j];
+  }
+}
+
+// Encrypt n bytes of buf at offset using VAES, 16 blocks at a time.
+// offset must be a multiple of 16 and n a multiple of 256.
+__attribute__((target("vaes,avx2,aes,ssse3")))
+static void vaesCtr(const U32* ek, int Nr, U64 iv,
+                    char* buf, int n, U64 offset) {
+  assert(offset%16==0 && n%256==0);
+  __m128i rk1[15];
+  aesniKeys(ek, Nr, rk1);
+  __m256i rk[15];
+  for (int r=0; r<=Nr; ++r) rk[r]=_mm256_broadcastsi128_si256(rk1[r]);
+  U64 i=offset/16;
+  for (int p=0; p<n; p+=256, i+=16) {
+    __m256i x[8];
+    for (int j=0; j<8; ++j)
+      x[j]=_mm256_xor_si256(_mm256_set_m128i(aesniCounter(iv, i+j*2+1),
+          aesniCounter(iv, i+j*2)), rk[0]);
+    for (int r=1; r<Nr; ++r)
+      for (int j=0; j<8; ++j) x[j]=_mm256_aesenc_epi128(x[j], rk[r]);
+    for (int j=0; j<8; ++j) {
+      __m256i* q=(__m256i*)(buf+p+j*32);
+      _mm256_storeu_si256(q, _mm256_xor_si256(_mm256_loadu_si256(q),
+          _mm256_aesenclast_epi128(x[j], rk[Nr])));
+    }
+  }
+}
+
+#endif // X86SIMD
+
 // Encrypt or decrypt slice buf[0..n-1] at offset by XOR with AES(i) where
 // i is the 128 bit big-endian distance from the start in 16 byte blocks.
+// Use VAES or AES-NI if the processor supports it.
 void AES_CTR::encrypt(char* buf, int n, U64 offset) {
+#ifdef X86SIMD
+  const int f=cpuFeatures();
+  if (f&CPU_AES) {
+    const U64 iv=U64(iv0)<<32|iv1;
+    if ((f&CPU_VAES) && n>=512) {
+      const int skip=(16-offset%16)%16;  // bytes to the next whole block
+      const int m=(n-skip)&-256;         // bytes done by vaesCtr()
+      aesniCtr(&ek[0], Nr, iv, buf, skip, offset);
+      vaesCtr(&ek[0], Nr, iv, buf+skip, m, offset+skip);
+      aesniCtr(&ek[0], Nr, iv, buf+skip+m, n-skip-m, offset+skip+m);
+    }
+    else
+      aesniCtr(&ek[0], Nr, iv, buf, n, offset);
+    return;
+  }
+#endif
   for (U64 i=offset/16; i<=(offset+n)/16; ++i) {
     unsigned char ct[16];
     encrypt(iv0, iv1, i>>32, i, ct);
@@ -886,6 +1367,12 @@ bool ZPAQL::write(Writer* out2, bool pp) {
 // Read header from in2
 int ZPAQL::read(Reader* in2) {
 
+  // Save the old program if it was compiled, to keep the code if the
+  // next block has the same header
+  std::string prev;
+  if ((rcode || ops.size()) && hend>0)
+    prev.assign((const char*)&header[0], hend);
+
   // Get header size and allocate
   int hsize=in2->get();
   hsize+=in2->get()*256;
@@ -924,7 +1411,10 @@ int ZPAQL::read(Reader* in2) {
   assert(hend>hbegin && hend<header.isize());
   assert(hsize==header[0]+256*header[1]);
   assert(hsize==cend-2+hend-hbegin);
-  allocx(rcode, rcode_size, 0);  // clear JIT code
+  if (int(prev.size())!=hend || memcmp(prev.data(), &header[0], hend)) {
+    allocx(rcode, rcode_size, 0);  // clear JIT code
+    ops.resize(0);
+  }
   return cend+hend-hbegin;
 }
 
@@ -932,10 +1422,13 @@ int ZPAQL::read(Reader* in2) {
 void ZPAQL::clear() {
   cend=hbegin=hend=0;  // COMP and HCOMP locations
   a=b=c=d=f=pc=0;      // machine state
+  native=nativeArg=0;  // no native PCOMP
+  nativeE8=false;
   header.resize(0);
   h.resize(0);
   m.resize(0);
   r.resize(0);
+  ops.resize(0);
   allocx(rcode, rcode_size, 0);
 }
 
@@ -960,12 +1453,14 @@ void ZPAQL::inith() {
   assert(output==0);
   assert(sha1==0);
   init(header[2], header[3]); // hh, hm
+  native=0;
 }
 
 // Initialize machine state as PCOMP
 void ZPAQL::initp() {
   assert(header.isize()>6);
   init(header[4], header[5]); // ph, pm
+  findNative();
 }
 
 // Flush pending output
@@ -1017,9 +1512,17 @@ void ZPAQL::init(int hbits, int mbits) {
   assert(outbuf.isize()>0);
   if (hbits>32) error("H too big");
   if (mbits>32) error("M too big");
-  h.resize(1, hbits);
-  m.resize(1, mbits);
-  r.resize(256);
+  if (rcode && hbits<32 && mbits<32 && h.size()==size_t(1)<<hbits
+      && m.size()==size_t(1)<<mbits && r.size()==256) {
+    memset(&h[0], 0, h.size()*sizeof(U32));  // JIT code has the addresses
+    memset(&m[0], 0, m.size());
+    memset(&r[0], 0, r.size()*sizeof(U32));
+  }
+  else {
+    h.resize(1, hbits);
+    m.resize(1, mbits);
+    r.resize(256);
+  }
   a=b=c=d=pc=f=0;
 }
 
@@ -1034,6 +1537,9 @@ void ZPAQL::run0(U32 input) {
   assert(header[0]+256*header[1]==cend+hend-hbegin-2);
   pc=hbegin;
   a=input;
+#ifdef THREADED
+  if (runThreaded()) return;
+#endif
   while (execute()) ;
 }
 
@@ -1261,6 +1767,389 @@ int ZPAQL::execute() {
   return 1;
 }
 
+#ifdef THREADED
+
+// Superinstructions for pairs of instructions common in the HCOMP code
+// that makeConfig() generates, numbered after the 256 opcodes
+enum {OP_AHASHD=256,  // A=*B HASHD
+      OP_HASHSTORE,   // HASH *D=A
+      OP_HASHBINC,    // HASH B++
+      OP_STOREDINC,   // *D=A D++
+      OP_LOADDINC,    // A=*D D++
+      OP_DZERO,       // D= N *D=0
+      OP_DLOAD,       // D= N A=*D
+      NOPS};
+
+// Length of the ZPAQL instruction with opcode op
+static int oplen(int op) {
+  return 1+(op%8==7)+(op==255);
+}
+
+// Superinstruction for op followed by op2, or 0 if none
+static int fuse(int op, int op2) {
+  if (op==68 && op2==60) return OP_AHASHD;
+  if (op==59 && op2==112) return OP_HASHSTORE;
+  if (op==59 && op2==9) return OP_HASHBINC;
+  if (op==112 && op2==25) return OP_STOREDINC;
+  if (op==70 && op2==25) return OP_LOADDINC;
+  if (op==95 && op2==52) return OP_DZERO;
+  if (op==95 && op2==70) return OP_DLOAD;
+  return 0;
+}
+
+// Decode HCOMP/PCOMP in header to ops[] for runThreaded(). Each op has
+// the handler jump[] of an instruction or superinstruction and its
+// operand or jump target index in ops. An instruction that is the
+// target of a jump is not fused with the one before it. If a jump goes
+// into an operand or out of hbegin..hend-1, then set ops[0].code=0 so
+// that the program is interpreted by execute() instead.
+void ZPAQL::decode(const void* const* jump) {
+  const U8* hc=&header[hbegin];
+  const int len=hend-hbegin;
+
+  // Find instructions (1) and jump targets (2)
+  Array<U8> kind(len+1);
+  for (int i=0; i<len; i+=oplen(hc[i]))
+    kind[i]=1;
+  for (int i=0; i<len; i+=oplen(hc[i])) {
+    int t=-1;
+    if (hc[i]==39 || hc[i]==47 || hc[i]==63)  // JT, JF, JMP
+      t=i+2+((hc[i+1]+128)&255)-128;
+    else if (hc[i]==255 && hc[i+1]+256*hc[i+2]<len)  // LJ
+      t=hc[i+1]+256*hc[i+2];
+    else continue;
+    if (t<0 || t>=len || !kind[t]) {
+      ops.resize(1);
+      ops[0].code=0;
+      return;
+    }
+    kind[t]=2;
+  }
+
+  // Number the ops, fusing pairs. ops[n] past the end is ERROR.
+  Array<int> at(len+1);  // header[hbegin+i] -> index in ops
+  int n=0;
+  for (int i=0; i<len; ++n) {
+    at[i]=n;
+    const int j=i+oplen(hc[i]);
+    i=j+(j<len && kind[j]==1 && fuse(hc[i], hc[j]));
+  }
+  at[len]=n;
+  ops.resize(n+1);
+  for (int i=0; i<len;) {
+    Op& o=ops[at[i]];
+    int op=hc[i];
+    o.n=hc[i+1];
+    if (op==39 || op==47 || op==63)
+      o.n=at[i+2+((hc[i+1]+128)&255)-128];
+    else if (op==255)
+      o.n=at[hc[i+1]+256*hc[i+2]<len ? hc[i+1]+256*hc[i+2] : len];
+    const int j=i+oplen(op);
+    i=j;
+    if (j<len && kind[j]==1 && fuse(op, hc[j]))
+      op=fuse(op, hc[j]), ++i;
+    o.code=jump[op];
+  }
+  ops[n].code=jump[0];
+}
+
+// Run the program in header with a=input as direct threaded code
+// decoded by decode(). Return false if it could not be decoded.
+bool ZPAQL::runThreaded() {
+  static const void* const jump[NOPS]={
+    &&op0, &&op1, &&op2, &&op3, &&op4, &&op0, &&op0, &&op7,
+    &&op8, &&op9, &&op10, &&op11, &&op12, &&op0, &&op0, &&op15,
+    &&op16, &&op17, &&op18, &&op19, &&op20, &&op0, &&op0, &&op23,
+    &&op24, &&op25, &&op26, &&op27, &&op28, &&op0, &&op0, &&op31,
+    &&op32, &&op33, &&op34, &&op35, &&op36, &&op0, &&op0, &&op39,
+    &&op40, &&op41, &&op42, &&op43, &&op44, &&op0, &&op0, &&op47,
+    &&op48, &&op49, &&op50, &&op51, &&op52, &&op0, &&op0, &&op55,
+    &&op56, &&op57, &&op0, &&op59, &&op60, &&op0, &&op0, &&op63,
+    &&op64, &&op65, &&op66, &&op67, &&op68, &&op69, &&op70, &&op71,
+    &&op72, &&op73, &&op74, &&op75, &&op76, &&op77, &&op78, &&op79,
+    &&op80, &&op81, &&op82, &&op83, &&op84, &&op85, &&op86, &&op87,
+    &&op88, &&op89, &&op90, &&op91, &&op92, &&op93, &&op94, &&op95,
+    &&op96, &&op97, &&op98, &&op99, &&op100, &&op101, &&op102, &&op103,
+    &&op104, &&op105, &&op106, &&op107, &&op108, &&op109, &&op110, &&op111,
+    &&op112, &&op113, &&op114, &&op115, &&op116, &&op117, &&op118, &&op119,
+    &&op0, &&op0, &&op0, &&op0, &&op0, &&op0, &&op0, &&op0,
+    &&op128, &&op129, &&op130, &&op131, &&op132, &&op133, &&op134, &&op135,
+    &&op136, &&op137, &&op138, &&op139, &&op140, &&op141, &&op142, &&op143,
+    &&op144, &&op145, &&op146, &&op147, &&op148, &&op149, &&op150, &&op151,
+    &&op152, &&op153, &&op154, &&op155, &&op156, &&op157, &&op158, &&op159,
+    &&op160, &&op161, &&op162, &&op163, &&op164, &&op165, &&op166, &&op167,
+    &&op168, &&op169, &&op170, &&op171, &&op172, &&op173, &&op174, &&op175,
+    &&op176, &&op177, &&op178, &&op179, &&op180, &&op181, &&op182, &&op183,
+    &&op184, &&op185, &&op186, &&op187, &&op188, &&op189, &&op190, &&op191,
+    &&op192, &&op193, &&op194, &&op195, &&op196, &&op197, &&op198, &&op199,
+    &&op200, &&op201, &&op202, &&op203, &&op204, &&op205, &&op206, &&op207,
+    &&op208, &&op209, &&op210, &&op211, &&op212, &&op213, &&op214, &&op215,
+    &&op216, &&op217, &&op218, &&op219, &&op220, &&op221, &&op222, &&op223,
+    &&op224, &&op225, &&op226, &&op227, &&op228, &&op229, &&op230, &&op231,
+    &&op232, &&op233, &&op234, &&op235, &&op236, &&op237, &&op238, &&op239,
+    &&op0, &&op0, &&op0, &&op0, &&op0, &&op0, &&op0, &&op0,
+    &&op0, &&op0, &&op0, &&op0, &&op0, &&op0, &&op0, &&op255,
+    &&ahashd, &&hashstore, &&hashbinc, &&storedinc, &&loaddinc, &&dzero,
+    &&dload};
+  if (ops.size()==0) decode(jump);
+  if (!ops[0].code) return false;
+
+  // Keep the machine state in local variables
+  U32 a=this->a, b=this->b, c=this->c, d=this->d;
+  int f=this->f;
+  U8* const M=&m[0];
+  U32* const H=&h[0];
+  U32* const R=&r[0];
+  const U32 mmask=U32(m.size()-1), hmask=U32(h.size()-1);
+  const Op* const code=&ops[0];
+  const Op* o=code;
+#define MB M[b&mmask]
+#define MC M[c&mmask]
+#define HD H[d&hmask]
+#define NEXT goto *(++o)->code
+#define JUMP {o=code+o->n; goto *o->code;}
+#define SWAP(x) a^=(x), (x)^=a, a^=(x)
+#define DIV(x) {U32 t=(x); if (t) a/=t; else a=0;}
+#define MOD(x) {U32 t=(x); if (t) a%=t; else a=0;}
+  goto *o->code;
+  op0: err(); // ERROR
+  op1: ++a; NEXT; // A++
+  op2: --a; NEXT; // A--
+  op3: a = ~a; NEXT; // A!
+  op4: a = 0; NEXT; // A=0
+  op7: a=R[o->n]; NEXT; // A=R N
+  op8: SWAP(b); NEXT; // B<>A
+  op9: ++b; NEXT; // B++
+  op10: --b; NEXT; // B--
+  op11: b = ~b; NEXT; // B!
+  op12: b = 0; NEXT; // B=0
+  op15: b=R[o->n]; NEXT; // B=R N
+  op16: SWAP(c); NEXT; // C<>A
+  op17: ++c; NEXT; // C++
+  op18: --c; NEXT; // C--
+  op19: c = ~c; NEXT; // C!
+  op20: c = 0; NEXT; // C=0
+  op23: c=R[o->n]; NEXT; // C=R N
+  op24: SWAP(d); NEXT; // D<>A
+  op25: ++d; NEXT; // D++
+  op26: --d; NEXT; // D--
+  op27: d = ~d; NEXT; // D!
+  op28: d = 0; NEXT; // D=0
+  op31: d=R[o->n]; NEXT; // D=R N
+  op32: SWAP(MB); NEXT; // *B<>A
+  op33: ++MB; NEXT; // *B++
+  op34: --MB; NEXT; // *B--
+  op35: MB = ~MB; NEXT; // *B!
+  op36: MB = 0; NEXT; // *B=0
+  op39: if (f) JUMP; NEXT; // JT N
+  op40: SWAP(MC); NEXT; // *C<>A
+  op41: ++MC; NEXT; // *C++
+  op42: --MC; NEXT; // *C--
+  op43: MC = ~MC; NEXT; // *C!
+  op44: MC = 0; NEXT; // *C=0
+  op47: if (!f) JUMP; NEXT; // JF N
+  op48: SWAP(HD); NEXT; // *D<>A
+  op49: ++HD; NEXT; // *D++
+  op50: --HD; NEXT; // *D--
+  op51: HD = ~HD; NEXT; // *D!
+  op52: HD = 0; NEXT; // *D=0
+  op55: R[o->n]=a; NEXT; // R=A N
+  op56: goto halt; // HALT
+  op57: outc(a&255); NEXT; // OUT
+  op59: a = (a+MB+512)*773; NEXT; // HASH
+  op60: HD = (HD+a+512)*773; NEXT; // HASHD
+  op63: JUMP; // JMP N
+  op64: NEXT; // A=A
+  op65: a = b; NEXT; // A=B
+  op66: a = c; NEXT; // A=C
+  op67: a = d; NEXT; // A=D
+  op68: a = MB; NEXT; // A=*B
+  op69: a = MC; NEXT; // A=*C
+  op70: a = HD; NEXT; // A=*D
+  op71: a = o->n; NEXT; // A= N
+  op72: b = a; NEXT; // B=A
+  op73: NEXT; // B=B
+  op74: b = c; NEXT; // B=C
+  op75: b = d; NEXT; // B=D
+  op76: b = MB; NEXT; // B=*B
+  op77: b = MC; NEXT; // B=*C
+  op78: b = HD; NEXT; // B=*D
+  op79: b = o->n; NEXT; // B= N
+  op80: c = a; NEXT; // C=A
+  op81: c = b; NEXT; // C=B
+  op82: NEXT; // C=C
+  op83: c = d; NEXT; // C=D
+  op84: c = MB; NEXT; // C=*B
+  op85: c = MC; NEXT; // C=*C
+  op86: c = HD; NEXT; // C=*D
+  op87: c = o->n; NEXT; // C= N
+  op88: d = a; NEXT; // D=A
+  op89: d = b; NEXT; // D=B
+  op90: d = c; NEXT; // D=C
+  op91: NEXT; // D=D
+  op92: d = MB; NEXT; // D=*B
+  op93: d = MC; NEXT; // D=*C
+  op94: d = HD; NEXT; // D=*D
+  op95: d = o->n; NEXT; // D= N
+  op96: MB = a; NEXT; // *B=A
+  op97: MB = b; NEXT; // *B=B
+  op98: MB = c; NEXT; // *B=C
+  op99: MB = d; NEXT; // *B=D
+  op100: NEXT; // *B=*B
+  op101: MB = MC; NEXT; // *B=*C
+  op102: MB = HD; NEXT; // *B=*D
+  op103: MB = o->n; NEXT; // *B= N
+  op104: MC = a; NEXT; // *C=A
+  op105: MC = b; NEXT; // *C=B
+  op106: MC = c; NEXT; // *C=C
+  op107: MC = d; NEXT; // *C=D
+  op108: MC = MB; NEXT; // *C=*B
+  op109: NEXT; // *C=*C
+  op110: MC = HD; NEXT; // *C=*D
+  op111: MC = o->n; NEXT; // *C= N
+  op112: HD = a; NEXT; // *D=A
+  op113: HD = b; NEXT; // *D=B
+  op114: HD = c; NEXT; // *D=C
+  op115: HD = d; NEXT; // *D=D
+  op116: HD = MB; NEXT; // *D=*B
+  op117: HD = MC; NEXT; // *D=*C
+  op118: NEXT; // *D=*D
+  op119: HD = o->n; NEXT; // *D= N
+  op128: a += a; NEXT; // A+=A
+  op129: a += b; NEXT; // A+=B
+  op130: a += c; NEXT; // A+=C
+  op131: a += d; NEXT; // A+=D
+  op132: a += MB; NEXT; // A+=*B
+  op133: a += MC; NEXT; // A+=*C
+  op134: a += HD; NEXT; // A+=*D
+  op135: a += o->n; NEXT; // A+= N
+  op136: a -= a; NEXT; // A-=A
+  op137: a -= b; NEXT; // A-=B
+  op138: a -= c; NEXT; // A-=C
+  op139: a -= d; NEXT; // A-=D
+  op140: a -= MB; NEXT; // A-=*B
+  op141: a -= MC; NEXT; // A-=*C
+  op142: a -= HD; NEXT; // A-=*D
+  op143: a -= o->n; NEXT; // A-= N
+  op144: a *= a; NEXT; // A*=A
+  op145: a *= b; NEXT; // A*=B
+  op146: a *= c; NEXT; // A*=C
+  op147: a *= d; NEXT; // A*=D
+  op148: a *= MB; NEXT; // A*=*B
+  op149: a *= MC; NEXT; // A*=*C
+  op150: a *= HD; NEXT; // A*=*D
+  op151: a *= o->n; NEXT; // A*= N
+  op152: DIV(a); NEXT; // A/=A
+  op153: DIV(b); NEXT; // A/=B
+  op154: DIV(c); NEXT; // A/=C
+  op155: DIV(d); NEXT; // A/=D
+  op156: DIV(MB); NEXT; // A/=*B
+  op157: DIV(MC); NEXT; // A/=*C
+  op158: DIV(HD); NEXT; // A/=*D
+  op159: DIV(o->n); NEXT; // A/= N
+  op160: MOD(a); NEXT; // A%=A
+  op161: MOD(b); NEXT; // A%=B
+  op162: MOD(c); NEXT; // A%=C
+  op163: MOD(d); NEXT; // A%=D
+  op164: MOD(MB); NEXT; // A%=*B
+  op165: MOD(MC); NEXT; // A%=*C
+  op166: MOD(HD); NEXT; // A%=*D
+  op167: MOD(o->n); NEXT; // A%= N
+  op168: a &= a; NEXT; // A&=A
+  op169: a &= b; NEXT; // A&=B
+  op170: a &= c; NEXT; // A&=C
+  op171: a &= d; NEXT; // A&=D
+  op172: a &= MB; NEXT; // A&=*B
+  op173: a &= MC; NEXT; // A&=*C
+  op174: a &= HD; NEXT; // A&=*D
+  op175: a &= o->n; NEXT; // A&= N
+  op176: a &= ~ a; NEXT; // A&~A
+  op177: a &= ~ b; NEXT; // A&~B
+  op178: a &= ~ c; NEXT; // A&~C
+  op179: a &= ~ d; NEXT; // A&~D
+  op180: a &= ~ MB; NEXT; // A&~*B
+  op181: a &= ~ MC; NEXT; // A&~*C
+  op182: a &= ~ HD; NEXT; // A&~*D
+  op183: a &= ~ o->n; NEXT; // A&~ N
+  op184: a |= a; NEXT; // A|=A
+  op185: a |= b; NEXT; // A|=B
+  op186: a |= c; NEXT; // A|=C
+  op187: a |= d; NEXT; // A|=D
+  op188: a |= MB; NEXT; // A|=*B
+  op189: a |= MC; NEXT; // A|=*C
+  op190: a |= HD; NEXT; // A|=*D
+  op191: a |= o->n; NEXT; // A|= N
+  op192: a ^= a; NEXT; // A^=A
+  op193: a ^= b; NEXT; // A^=B
+  op194: a ^= c; NEXT; // A^=C
+  op195: a ^= d; NEXT; // A^=D
+  op196: a ^= MB; NEXT; // A^=*B
+  op197: a ^= MC; NEXT; // A^=*C
+  op198: a ^= HD; NEXT; // A^=*D
+  op199: a ^= o->n; NEXT; // A^= N
+  op200: a <<= (a&31); NEXT; // A<<=A
+  op201: a <<= (b&31); NEXT; // A<<=B
+  op202: a <<= (c&31); NEXT; // A<<=C
+  op203: a <<= (d&31); NEXT; // A<<=D
+  op204: a <<= (MB&31); NEXT; // A<<=*B
+  op205: a <<= (MC&31); NEXT; // A<<=*C
+  op206: a <<= (HD&31); NEXT; // A<<=*D
+  op207: a <<= (o->n&31); NEXT; // A<<= N
+  op208: a >>= (a&31); NEXT; // A>>=A
+  op209: a >>= (b&31); NEXT; // A>>=B
+  op210: a >>= (c&31); NEXT; // A>>=C
+  op211: a >>= (d&31); NEXT; // A>>=D
+  op212: a >>= (MB&31); NEXT; // A>>=*B
+  op213: a >>= (MC&31); NEXT; // A>>=*C
+  op214: a >>= (HD&31); NEXT; // A>>=*D
+  op215: a >>= (o->n&31); NEXT; // A>>= N
+  op216: f = 1; NEXT; // A==A
+  op217: f = (a == b); NEXT; // A==B
+  op218: f = (a == c); NEXT; // A==C
+  op219: f = (a == d); NEXT; // A==D
+  op220: f = (a == U32(MB)); NEXT; // A==*B
+  op221: f = (a == U32(MC)); NEXT; // A==*C
+  op222: f = (a == HD); NEXT; // A==*D
+  op223: f = (a == o->n); NEXT; // A== N
+  op224: f = 0; NEXT; // A<A
+  op225: f = (a < b); NEXT; // A<B
+  op226: f = (a < c); NEXT; // A<C
+  op227: f = (a < d); NEXT; // A<D
+  op228: f = (a < U32(MB)); NEXT; // A<*B
+  op229: f = (a < U32(MC)); NEXT; // A<*C
+  op230: f = (a < HD); NEXT; // A<*D
+  op231: f = (a < o->n); NEXT; // A< N
+  op232: f = 0; NEXT; // A>A
+  op233: f = (a > b); NEXT; // A>B
+  op234: f = (a > c); NEXT; // A>C
+  op235: f = (a > d); NEXT; // A>D
+  op236: f = (a > U32(MB)); NEXT; // A>*B
+  op237: f = (a > U32(MC)); NEXT; // A>*C
+  op238: f = (a > HD); NEXT; // A>*D
+  op239: f = (a > o->n); NEXT; // A> N
+  op255: JUMP; // LJ
+  ahashd: a = MB; HD = (HD+a+512)*773; NEXT; // A=*B HASHD
+  hashstore: a = (a+MB+512)*773; HD = a; NEXT; // HASH *D=A
+  hashbinc: a = (a+MB+512)*773; ++b; NEXT; // HASH B++
+  storedinc: HD = a; ++d; NEXT; // *D=A D++
+  loaddinc: a = HD; ++d; NEXT; // A=*D D++
+  dzero: d = o->n; HD = 0; NEXT; // D= N *D=0
+  dload: d = o->n; a = HD; NEXT; // D= N A=*D
+#undef MB
+#undef MC
+#undef HD
+#undef NEXT
+#undef JUMP
+#undef SWAP
+#undef DIV
+#undef MOD
+  halt:
+  this->a=a, this->b=b, this->c=c, this->d=d, this->f=f;
+  return true;
+}
+
+#endif // ifdef THREADED
+
 // Print illegal instruction error message and exit
 void ZPAQL::err() {
   error("ZPAQL execution error");
@@ -1702,35 +2591,14 @@ static const U8 stdt[712]={
      0,     0,     0,     0,     0,     0,     1,     0
 };
 
-Predictor::Predictor(ZPAQL& zr):
-    c8(1), hmap4(1), z(zr) {
-  assert(sizeof(U8)==1);
-  assert(sizeof(U16)==2);
-  assert(sizeof(U32)==4);
-  assert(sizeof(U64)==8);
-  assert(sizeof(short)==2);
-  assert(sizeof(int)==4);
-  pcode=0;
-  pcode_size=0;
-  initTables=false;
-}
-
-Predictor::~Predictor() {
-  allocx(pcode, pcode_size, 0);  // free executable memory
-}
-
-// Initialize the predictor with a new model in z
-void Predictor::init() {
-
-  // Clear old JIT code if any
-  allocx(pcode, pcode_size, 0);
-
-  // Initialize context hash function
-  z.inith();
-
-  // Initialize model independent tables
-  if (!initTables && isModeled()) {
-    initTables=true;
+// Model independent tables, computed once and copied into each Predictor
+// where the JIT code can address them relative to the Predictor
+struct PredictorTables {
+  int dt2k[256];        // division table for match: dt2k[i] = 2^12/i
+  int dt[1024];         // division table for cm: dt[i] = 2^16/(i+1.5)
+  U16 squasht[4096];    // squash() lookup table
+  short stretcht[32768];// stretch() lookup table
+  PredictorTables() {
     memcpy(dt2k, sdt2k, sizeof(dt2k));
     memcpy(dt, sdt, sizeof(dt));
 
@@ -1753,33 +2621,92 @@ void Predictor::init() {
     // Verify floating point math for squash() and stretch()
     U32 sqsum=0, stsum=0;
     for (int i=32767; i>=0; --i)
-      stsum=stsum*3+stretch(i);
+      stsum=stsum*3+stretcht[i];
     for (int i=4095; i>=0; --i)
-      sqsum=sqsum*3+squash(i-2048);
+      sqsum=sqsum*3+squasht[i];
     assert(stsum==3887533746u);
     assert(sqsum==2278286169u);
 #endif
   }
+};
+
+Predictor::Predictor(ZPAQL& zr):
+    c8(1), hmap4(1), z(zr) {
+  assert(sizeof(U8)==1);
+  assert(sizeof(U16)==2);
+  assert(sizeof(U32)==4);
+  assert(sizeof(U64)==8);
+  assert(sizeof(short)==2);
+  assert(sizeof(int)==4);
+  pcode=0;
+  pcode_size=0;
+  initTables=false;
+  predictk=0;
+  updatek=0;
+}
+
+Predictor::~Predictor() {
+  allocx(pcode, pcode_size, 0);  // free executable memory
+}
+
+// Resize a to n*2^ex elements like Array::resize(). If it already has
+// that size then keep its memory, and clear it if zero is true.
+template <class T>
+static void reuse(Array<T>& a, size_t n, int ex=0, bool zero=true) {
+  size_t sz=n;
+  for (int i=0; i<ex && sz<sz*2; ++i) sz*=2;
+  if (sz>0 && a.size()==sz) {
+    if (zero) memset(&a[0], 0, sz*sizeof(T));
+  }
+  else
+    a.resize(n, ex);
+}
+
+// Initialize the predictor with a new model in z. Memory and JIT code
+// from the last model are kept where the new model has the same shape.
+void Predictor::init() {
+
+  // Clear old JIT code if the components changed
+  const int nc=z.cend-6;  // size of n (comp)[n] END
+  if (nc<=0 || model.isize()!=nc || memcmp(&model[0], &z.header[6], nc)) {
+    allocx(pcode, pcode_size, 0);
+    model.resize(nc>0 ? nc : 0);
+    if (nc>0) memcpy(&model[0], &z.header[6], nc);
+  }
+
+  // Initialize context hash function
+  z.inith();
+
+  // Initialize model independent tables
+  if (!initTables && isModeled()) {
+    static const PredictorTables t;
+    initTables=true;
+    memcpy(dt2k, t.dt2k, sizeof(dt2k));
+    memcpy(dt, t.dt, sizeof(dt));
+    memcpy(squasht, t.squasht, sizeof(squasht));
+    memcpy(stretcht, t.stretcht, sizeof(stretcht));
+  }
 
   // Initialize predictions
   for (int i=0; i<256; ++i) h[i]=p[i]=0;
 
   // Initialize components
-  for (int i=0; i<256; ++i)  // clear old model
-    comp[i].init();
   int n=z.header[6]; // hsize[0..1] hh hm ph pm n (comp)[n] END 0[128] (hcomp) END
+  for (int i=n; i<256; ++i)  // clear old model
+    comp[i].init();
   const U8* cp=&z.header[7];  // start of component list
   for (int i=0; i<n; ++i) {
     assert(cp<&z.header[z.cend]);
     assert(cp>&z.header[0] && cp<&z.header[z.header.isize()-8]);
     Component& cr=comp[i];
+    cr.limit=cr.cxt=cr.a=cr.b=cr.c=0;
     switch(cp[0]) {
       case CONS:  // c
         p[i]=(cp[1]-128)*4;
         break;
       case CM: // sizebits limit
         if (cp[1]>32) error("max size for CM is 32");
-        cr.cm.resize(1, cp[1]);  // packed CM (22 bits) + CMCOUNT (10 bits)
+        reuse(cr.cm, 1, cp[1], false);  // packed CM (22 bits) + count (10)
         cr.limit=cp[2]*4;
         for (size_t j=0; j<cr.cm.size(); ++j)
           cr.cm[j]=0x80000000;
@@ -1787,15 +2714,15 @@ void Predictor::init() {
       case ICM: // sizebits
         if (cp[1]>26) error("max size for ICM is 26");
         cr.limit=1023;
-        cr.cm.resize(256);
-        cr.ht.resize(64, cp[1]);
+        reuse(cr.cm, 256, 0, false);
+        reuse(cr.ht, 64, cp[1]);
         for (size_t j=0; j<cr.cm.size(); ++j)
           cr.cm[j]=st.cminit(j);
         break;
       case MATCH:  // sizebits
         if (cp[1]>32 || cp[2]>32) error("max size for MATCH is 32 32");
-        cr.cm.resize(1, cp[1]);  // index
-        cr.ht.resize(1, cp[2]);  // buf
+        reuse(cr.cm, 1, cp[1]);  // index
+        reuse(cr.ht, 1, cp[2]);  // buf
         cr.ht(0)=1;
         break;
       case AVG: // j k wt
@@ -1807,7 +2734,7 @@ void Predictor::init() {
         if (cp[3]>=i) error("MIX2 k >= i");
         if (cp[2]>=i) error("MIX2 j >= i");
         cr.c=(size_t(1)<<cp[1]); // size (number of contexts)
-        cr.a16.resize(1, cp[1]);  // wt[size][m]
+        reuse(cr.a16, 1, cp[1], false);  // wt[size][m]
         for (size_t j=0; j<cr.a16.size(); ++j)
           cr.a16[j]=32768;
         break;
@@ -1818,7 +2745,7 @@ void Predictor::init() {
         int m=cp[3];  // number of inputs
         assert(m>=1);
         cr.c=(size_t(1)<<cp[1]); // size (number of contexts)
-        cr.cm.resize(m, cp[1]);  // wt[size][m]
+        reuse(cr.cm, m, cp[1], false);  // wt[size][m]
         for (size_t j=0; j<cr.cm.size(); ++j)
           cr.cm[j]=65536/m;
         break;
@@ -1826,8 +2753,8 @@ void Predictor::init() {
       case ISSE:  // sizebits j
         if (cp[1]>32) error("max size for ISSE is 32");
         if (cp[2]>=i) error("ISSE j >= i");
-        cr.ht.resize(64, cp[1]);
-        cr.cm.resize(512);
+        reuse(cr.ht, 64, cp[1]);
+        reuse(cr.cm, 512, 0, false);
         for (int j=0; j<256; ++j) {
           cr.cm[j*2]=1<<15;
           cr.cm[j*2+1]=clamp512k(stretch(st.cminit(j)>>8)*1024);
@@ -1837,17 +2764,210 @@ void Predictor::init() {
         if (cp[1]>32) error("max size for SSE is 32");
         if (cp[2]>=i) error("SSE j >= i");
         if (cp[3]>cp[4]*4) error("SSE start > limit*4");
-        cr.cm.resize(32, cp[1]);
+        reuse(cr.cm, 32, cp[1], false);
         cr.limit=cp[4]*4;
         for (size_t j=0; j<cr.cm.size(); ++j)
           cr.cm[j]=squash((j&31)*64-992)<<17|cp[3];
         break;
       default: error("unknown component type");
     }
+
+    // Free arrays of the last model that this component does not use
+    if (cp[0]==CONS || cp[0]==AVG || cp[0]==MIX2) cr.cm.resize(0);
+    if (cp[0]!=ICM && cp[0]!=MATCH && cp[0]!=ISSE) cr.ht.resize(0);
+    if (cp[0]!=MIX2) cr.a16.resize(0);
     assert(compsize[*cp]>0);
     cp+=compsize[*cp];
     assert(cp>=&z.header[7] && cp<&z.header[z.cend]);
   }
+  findKernel();
+}
+
+// Predict component i of type T with parameters at cp
+template <int T> FORCE_INLINE void Predictor::predictComp(int i, const U8* cp) {
+  Component& cr=comp[i];
+  switch(T) {
+    case CONS:  // c
+      break;
+    case CM:  // sizebits limit
+      cr.cxt=h[i]^hmap4;
+      p[i]=stretch(cr.cm(cr.cxt)>>17);
+      break;
+    case ICM: // sizebits
+      assert((hmap4&15)>0);
+      if (c8==1 || (c8&0xf0)==16) cr.c=find(cr.ht, cp[1]+2, h[i]+16*c8);
+      cr.cxt=cr.ht[cr.c+(hmap4&15)];
+      p[i]=stretch(cr.cm(cr.cxt)>>8);
+      break;
+    case MATCH: // sizebits bufbits: a=len, b=offset, c=bit, cxt=bitpos,
+                //                   ht=buf, limit=pos
+      assert(cr.cm.size()==(size_t(1)<<cp[1]));
+      assert(cr.ht.size()==(size_t(1)<<cp[2]));
+      assert(cr.a<=255);
+      assert(cr.c==0 || cr.c==1);
+      assert(cr.cxt<8);
+      assert(cr.limit<cr.ht.size());
+      if (cr.a==0) p[i]=0;
+      else {
+        cr.c=(cr.ht(cr.limit-cr.b)>>(7-cr.cxt))&1; // predicted bit
+        p[i]=stretch(dt2k[cr.a]*(cr.c*-2+1)&32767);
+      }
+      break;
+    case AVG: // j k wt
+      p[i]=(p[cp[1]]*cp[3]+p[cp[2]]*(256-cp[3]))>>8;
+      break;
+    case MIX2: { // sizebits j k rate mask
+                 // c=size cm=wt[size] cxt=input
+      cr.cxt=((h[i]+(c8&cp[5]))&(cr.c-1));
+      assert(cr.cxt<cr.a16.size());
+      int w=cr.a16[cr.cxt];
+      assert(w>=0 && w<65536);
+      p[i]=(w*p[cp[2]]+(65536-w)*p[cp[3]])>>16;
+      assert(p[i]>=-2048 && p[i]<2048);
+    }
+      break;
+    case MIX: {  // sizebits j m rate mask
+                 // c=size cm=wt[size][m] cxt=index of wt in cm
+      int m=cp[3];
+      assert(m>=1 && m<=i);
+      cr.cxt=h[i]+(c8&cp[5]);
+      cr.cxt=(cr.cxt&(cr.c-1))*m; // pointer to row of weights
+      assert(cr.cxt<=cr.cm.size()-m);
+      int* wt=(int*)&cr.cm[cr.cxt];
+      p[i]=0;
+      for (int j=0; j<m; ++j)
+        p[i]+=(wt[j]>>8)*p[cp[2]+j];
+      p[i]=clamp2k(p[i]>>8);
+    }
+      break;
+    case ISSE: { // sizebits j -- c=hi, cxt=bh
+      assert((hmap4&15)>0);
+      if (c8==1 || (c8&0xf0)==16)
+        cr.c=find(cr.ht, cp[1]+2, h[i]+16*c8);
+      cr.cxt=cr.ht[cr.c+(hmap4&15)];  // bit history
+      int *wt=(int*)&cr.cm[cr.cxt*2];
+      p[i]=clamp2k((wt[0]*p[cp[2]]+wt[1]*64)>>16);
+    }
+      break;
+    case SSE: { // sizebits j start limit
+      cr.cxt=(h[i]+c8)*32;
+      int pq=p[cp[2]]+992;
+      if (pq<0) pq=0;
+      if (pq>1983) pq=1983;
+      int wt=pq&63;
+      pq>>=6;
+      assert(pq>=0 && pq<=30);
+      cr.cxt+=pq;
+      p[i]=stretch(((cr.cm(cr.cxt)>>10)*(64-wt)+(cr.cm(cr.cxt+1)>>10)*wt)>>13);
+      cr.cxt+=wt>>5;
+    }
+      break;
+    default:
+      error("component predict not implemented");
+  }
+  assert(p[i]>=-2048 && p[i]<2048);
+}
+
+// Update component i of type T with parameters at cp with bit y
+template <int T>
+FORCE_INLINE void Predictor::updateComp(int i, const U8* cp, int y) {
+  Component& cr=comp[i];
+  switch(T) {
+    case CONS:  // c
+      break;
+    case CM:  // sizebits limit
+      train(cr, y);
+      break;
+    case ICM: { // sizebits: cxt=ht[b]=bh, ht[c][0..15]=bh row, cxt=bh
+      cr.ht[cr.c+(hmap4&15)]=st.next(cr.ht[cr.c+(hmap4&15)], y);
+      U32& pn=cr.cm(cr.cxt);
+      pn+=int(y*32767-(pn>>8))>>2;
+    }
+      break;
+    case MATCH: // sizebits bufbits:
+                //   a=len, b=offset, c=bit, cm=index, cxt=bitpos
+                //   ht=buf, limit=pos
+    {
+      assert(cr.a<=255);
+      assert(cr.c==0 || cr.c==1);
+      assert(cr.cxt<8);
+      assert(cr.cm.size()==(size_t(1)<<cp[1]));
+      assert(cr.ht.size()==(size_t(1)<<cp[2]));
+      assert(cr.limit<cr.ht.size());
+      if (int(cr.c)!=y) cr.a=0;  // mismatch?
+      cr.ht(cr.limit)+=cr.ht(cr.limit)+y;
+      if (++cr.cxt==8) {
+        cr.cxt=0;
+        ++cr.limit;
+        cr.limit&=(1<<cp[2])-1;
+        if (cr.a==0) {  // look for a match
+          cr.b=cr.limit-cr.cm(h[i]);
+          if (cr.b&(cr.ht.size()-1))
+            while (cr.a<255
+                   && cr.ht(cr.limit-cr.a-1)==cr.ht(cr.limit-cr.a-cr.b-1))
+              ++cr.a;
+        }
+        else cr.a+=cr.a<255;
+        cr.cm(h[i])=cr.limit;
+      }
+    }
+      break;
+    case AVG:  // j k wt
+      break;
+    case MIX2: { // sizebits j k rate mask
+                 // cm=wt[size], cxt=input
+      assert(cr.a16.size()==cr.c);
+      assert(cr.cxt<cr.a16.size());
+      int err=(y*32767-squash(p[i]))*cp[4]>>5;
+      int w=cr.a16[cr.cxt];
+      w+=(err*(p[cp[2]]-p[cp[3]])+(1<<12))>>13;
+      if (w<0) w=0;
+      if (w>65535) w=65535;
+      cr.a16[cr.cxt]=w;
+    }
+      break;
+    case MIX: {   // sizebits j m rate mask
+                  // cm=wt[size][m], cxt=input
+      int m=cp[3];
+      assert(m>0 && m<=i);
+      assert(cr.cm.size()==m*cr.c);
+      assert(cr.cxt+m<=cr.cm.size());
+      int err=(y*32767-squash(p[i]))*cp[4]>>4;
+      int* wt=(int*)&cr.cm[cr.cxt];
+      for (int j=0; j<m; ++j)
+        wt[j]=clamp512k(wt[j]+((err*p[cp[2]+j]+(1<<12))>>13));
+    }
+      break;
+    case ISSE: { // sizebits j  -- c=hi, cxt=bh
+      assert(cr.cxt==cr.ht[cr.c+(hmap4&15)]);
+      int err=y*32767-squash(p[i]);
+      int *wt=(int*)&cr.cm[cr.cxt*2];
+      wt[0]=clamp512k(wt[0]+((err*p[cp[2]]+(1<<12))>>13));
+      wt[1]=clamp512k(wt[1]+((err+16)>>5));
+      cr.ht[cr.c+(hmap4&15)]=st.next(cr.cxt, y);
+    }
+      break;
+    case SSE:  // sizebits j start limit
+      train(cr, y);
+      break;
+    default:
+      assert(0);
+  }
+}
+
+// Save bit y in c8, hmap4 and compute new contexts after a whole byte
+inline void Predictor::updateContext(int y) {
+  c8+=c8+y;
+  if (c8>=256) {
+    z.run(c8-256);
+    hmap4=1;
+    c8=1;
+    for (int i=0; i<z.header[6]; ++i) h[i]=z.H(i);
+  }
+  else if (c8>=16 && c8<32)
+    hmap4=(hmap4&0xf)<<5|y<<4|1;
+  else
+    hmap4=(hmap4&0x1f0)|(((hmap4&0xf)*2+y)&0xf);
 }
 
 // Return next bit prediction using interpreted COMP code
@@ -1862,89 +2982,20 @@ int Predictor::predict0() {
   assert(cp[-1]==n);
   for (int i=0; i<n; ++i) {
     assert(cp>&z.header[0] && cp<&z.header[z.header.isize()-8]);
-    Component& cr=comp[i];
     switch(cp[0]) {
-      case CONS:  // c
-        break;
-      case CM:  // sizebits limit
-        cr.cxt=h[i]^hmap4;
-        p[i]=stretch(cr.cm(cr.cxt)>>17);
-        break;
-      case ICM: // sizebits
-        assert((hmap4&15)>0);
-        if (c8==1 || (c8&0xf0)==16) cr.c=find(cr.ht, cp[1]+2, h[i]+16*c8);
-        cr.cxt=cr.ht[cr.c+(hmap4&15)];
-        p[i]=stretch(cr.cm(cr.cxt)>>8);
-        break;
-      case MATCH: // sizebits bufbits: a=len, b=offset, c=bit, cxt=bitpos,
-                  //                   ht=buf, limit=pos
-        assert(cr.cm.size()==(size_t(1)<<cp[1]));
-        assert(cr.ht.size()==(size_t(1)<<cp[2]));
-        assert(cr.a<=255);
-        assert(cr.c==0 || cr.c==1);
-        assert(cr.cxt<8);
-        assert(cr.limit<cr.ht.size());
-        if (cr.a==0) p[i]=0;
-        else {
-          cr.c=(cr.ht(cr.limit-cr.b)>>(7-cr.cxt))&1; // predicted bit
-          p[i]=stretch(dt2k[cr.a]*(cr.c*-2+1)&32767);
-        }
-        break;
-      case AVG: // j k wt
-        p[i]=(p[cp[1]]*cp[3]+p[cp[2]]*(256-cp[3]))>>8;
-        break;
-      case MIX2: { // sizebits j k rate mask
-                   // c=size cm=wt[size] cxt=input
-        cr.cxt=((h[i]+(c8&cp[5]))&(cr.c-1));
-        assert(cr.cxt<cr.a16.size());
-        int w=cr.a16[cr.cxt];
-        assert(w>=0 && w<65536);
-        p[i]=(w*p[cp[2]]+(65536-w)*p[cp[3]])>>16;
-        assert(p[i]>=-2048 && p[i]<2048);
-      }
-        break;
-      case MIX: {  // sizebits j m rate mask
-                   // c=size cm=wt[size][m] cxt=index of wt in cm
-        int m=cp[3];
-        assert(m>=1 && m<=i);
-        cr.cxt=h[i]+(c8&cp[5]);
-        cr.cxt=(cr.cxt&(cr.c-1))*m; // pointer to row of weights
-        assert(cr.cxt<=cr.cm.size()-m);
-        int* wt=(int*)&cr.cm[cr.cxt];
-        p[i]=0;
-        for (int j=0; j<m; ++j)
-          p[i]+=(wt[j]>>8)*p[cp[2]+j];
-        p[i]=clamp2k(p[i]>>8);
-      }
-        break;
-      case ISSE: { // sizebits j -- c=hi, cxt=bh
-        assert((hmap4&15)>0);
-        if (c8==1 || (c8&0xf0)==16)
-          cr.c=find(cr.ht, cp[1]+2, h[i]+16*c8);
-        cr.cxt=cr.ht[cr.c+(hmap4&15)];  // bit history
-        int *wt=(int*)&cr.cm[cr.cxt*2];
-        p[i]=clamp2k((wt[0]*p[cp[2]]+wt[1]*64)>>16);
-      }
-        break;
-      case SSE: { // sizebits j start limit
-        cr.cxt=(h[i]+c8)*32;
-        int pq=p[cp[2]]+992;
-        if (pq<0) pq=0;
-        if (pq>1983) pq=1983;
-        int wt=pq&63;
-        pq>>=6;
-        assert(pq>=0 && pq<=30);
-        cr.cxt+=pq;
-        p[i]=stretch(((cr.cm(cr.cxt)>>10)*(64-wt)+(cr.cm(cr.cxt+1)>>10)*wt)>>13);
-        cr.cxt+=wt>>5;
-      }
-        break;
-      default:
-        error("component predict not implemented");
+      case CONS: predictComp<CONS>(i, cp); break;
+      case CM: predictComp<CM>(i, cp); break;
+      case ICM: predictComp<ICM>(i, cp); break;
+      case MATCH: predictComp<MATCH>(i, cp); break;
+      case AVG: predictComp<AVG>(i, cp); break;
+      case MIX2: predictComp<MIX2>(i, cp); break;
+      case MIX: predictComp<MIX>(i, cp); break;
+      case ISSE: predictComp<ISSE>(i, cp); break;
+      case SSE: predictComp<SSE>(i, cp); break;
+      default: error("component predict not implemented");
     }
     cp+=compsize[cp[0]];
     assert(cp<&z.header[z.cend]);
-    assert(p[i]>=-2048 && p[i]<2048);
   }
   assert(cp[0]==NONE);
   return squash(p[n-1]);
@@ -1963,87 +3014,17 @@ void Predictor::update0(int y) {
   assert(n>=1 && n<=255);
   assert(cp[-1]==n);
   for (int i=0; i<n; ++i) {
-    Component& cr=comp[i];
     switch(cp[0]) {
-      case CONS:  // c
-        break;
-      case CM:  // sizebits limit
-        train(cr, y);
-        break;
-      case ICM: { // sizebits: cxt=ht[b]=bh, ht[c][0..15]=bh row, cxt=bh
-        cr.ht[cr.c+(hmap4&15)]=st.next(cr.ht[cr.c+(hmap4&15)], y);
-        U32& pn=cr.cm(cr.cxt);
-        pn+=int(y*32767-(pn>>8))>>2;
-      }
-        break;
-      case MATCH: // sizebits bufbits:
-                  //   a=len, b=offset, c=bit, cm=index, cxt=bitpos
-                  //   ht=buf, limit=pos
-      {
-        assert(cr.a<=255);
-        assert(cr.c==0 || cr.c==1);
-        assert(cr.cxt<8);
-        assert(cr.cm.size()==(size_t(1)<<cp[1]));
-        assert(cr.ht.size()==(size_t(1)<<cp[2]));
-        assert(cr.limit<cr.ht.size());
-        if (int(cr.c)!=y) cr.a=0;  // mismatch?
-        cr.ht(cr.limit)+=cr.ht(cr.limit)+y;
-        if (++cr.cxt==8) {
-          cr.cxt=0;
-          ++cr.limit;
-          cr.limit&=(1<<cp[2])-1;
-          if (cr.a==0) {  // look for a match
-            cr.b=cr.limit-cr.cm(h[i]);
-            if (cr.b&(cr.ht.size()-1))
-              while (cr.a<255
-                     && cr.ht(cr.limit-cr.a-1)==cr.ht(cr.limit-cr.a-cr.b-1))
-                ++cr.a;
-          }
-          else cr.a+=cr.a<255;
-          cr.cm(h[i])=cr.limit;
-        }
-      }
-        break;
-      case AVG:  // j k wt
-        break;
-      case MIX2: { // sizebits j k rate mask
-                   // cm=wt[size], cxt=input
-        assert(cr.a16.size()==cr.c);
-        assert(cr.cxt<cr.a16.size());
-        int err=(y*32767-squash(p[i]))*cp[4]>>5;
-        int w=cr.a16[cr.cxt];
-        w+=(err*(p[cp[2]]-p[cp[3]])+(1<<12))>>13;
-        if (w<0) w=0;
-        if (w>65535) w=65535;
-        cr.a16[cr.cxt]=w;
-      }
-        break;
-      case MIX: {   // sizebits j m rate mask
-                    // cm=wt[size][m], cxt=input
-        int m=cp[3];
-        assert(m>0 && m<=i);
-        assert(cr.cm.size()==m*cr.c);
-        assert(cr.cxt+m<=cr.cm.size());
-        int err=(y*32767-squash(p[i]))*cp[4]>>4;
-        int* wt=(int*)&cr.cm[cr.cxt];
-        for (int j=0; j<m; ++j)
-          wt[j]=clamp512k(wt[j]+((err*p[cp[2]+j]+(1<<12))>>13));
-      }
-        break;
-      case ISSE: { // sizebits j  -- c=hi, cxt=bh
-        assert(cr.cxt==cr.ht[cr.c+(hmap4&15)]);
-        int err=y*32767-squash(p[i]);
-        int *wt=(int*)&cr.cm[cr.cxt*2];
-        wt[0]=clamp512k(wt[0]+((err*p[cp[2]]+(1<<12))>>13));
-        wt[1]=clamp512k(wt[1]+((err+16)>>5));
-        cr.ht[cr.c+(hmap4&15)]=st.next(cr.cxt, y);
-      }
-        break;
-      case SSE:  // sizebits j start limit
-        train(cr, y);
-        break;
-      default:
-        assert(0);
+      case CONS: updateComp<CONS>(i, cp, y); break;
+      case CM: updateComp<CM>(i, cp, y); break;
+      case ICM: updateComp<ICM>(i, cp, y); break;
+      case MATCH: updateComp<MATCH>(i, cp, y); break;
+      case AVG: updateComp<AVG>(i, cp, y); break;
+      case MIX2: updateComp<MIX2>(i, cp, y); break;
+      case MIX: updateComp<MIX>(i, cp, y); break;
+      case ISSE: updateComp<ISSE>(i, cp, y); break;
+      case SSE: updateComp<SSE>(i, cp, y); break;
+      default: assert(0);
     }
     cp+=compsize[cp[0]];
     assert(cp>=&z.header[7] && cp<&z.header[z.cend] 
@@ -2051,20 +3032,137 @@ void Predictor::update0(int y) {
   }
   assert(cp[0]==NONE);
 
-  // Save bit y in c8, hmap4
-  c8+=c8+y;
-  if (c8>=256) {
-    z.run(c8-256);
-    hmap4=1;
-    c8=1;
-    for (int i=0; i<n; ++i) h[i]=z.H(i);
-  }
-  else if (c8>=16 && c8<32)
-    hmap4=(hmap4&0xf)<<5|y<<4|1;
-  else
-    hmap4=(hmap4&0x1f0)|(((hmap4&0xf)*2+y)&0xf);
+  updateContext(y);
+}
+
+/////////////////// Specialized predictors ////////////////////
+
+// Without the JIT, the models that compressBlock() generates for levels
+// 3-5 are compiled as kernels specialized on their list of component
+// types, so the component loop and type dispatch of predict0() and
+// update0() are unrolled at compile time. Component parameters are still
+// read from the COMP header, so the kernels are exact for any model with
+// a matching type list. The JIT code is faster where available.
+
+#ifdef NOJIT
+
+// A list of component types: type T followed by list N
+struct CompEnd {enum {size=0};};
+template <int T, class N=CompEnd> struct Comps {
+  enum {type=T, size=N::size+1};
+  typedef N next;
+};
+
+// n copies of component type T followed by list N
+template <int n, int T, class N> struct CompRepeat {
+  typedef Comps<T, typename CompRepeat<n-1, T, N>::type> type;
+};
+template <int T, class N> struct CompRepeat<0, T, N> {
+  typedef N type;
+};
+
+// n ICM-ISSE chains followed by list N
+template <int n, class N> struct CompChain {
+  typedef Comps<ICM, Comps<ISSE, typename CompChain<n-1, N>::type> > type;
+};
+template <class N> struct CompChain<0, N> {
+  typedef N type;
+};
+
+// Level 3-4 BWT and LZ77 (x4.3ci1, x4.2...c0,0,511i2, x4.2...c0,0,511)
+typedef Comps<ICM> ModelC;
+typedef CompChain<1, CompEnd>::type ModelCI;
+
+// Level 4 fast CM (x4.0ci1,1,1,1,2am) and with a word model (...awm)
+typedef Comps<ICM, CompRepeat<5, ISSE, Comps<MATCH, Comps<MIX> > >::type>
+  ModelL4;
+typedef Comps<ICM, CompRepeat<5, ISSE, Comps<MATCH, Comps<ICM, Comps<MIX> > >
+  >::type> ModelL4W;
+
+// Level 5: a binary (w1i1) or text (w2c0,1010,255i1) word model of w
+// ICM-ISSE chains, order 0-6 (c256ci1,1,1,1,1,1,2a), up to 4 chains of
+// periodic models, order 2-4 sparse models, and the final mixers.
+template <int w, int periodic> struct ModelL5 {
+  typedef Comps<MIX, Comps<MIX, Comps<MIX2, Comps<SSE, Comps<MIX2> > > > >
+    mixers;
+  typedef Comps<CM, Comps<ICM, typename CompRepeat<7, ISSE, Comps<MATCH,
+    typename CompChain<periodic+3, mixers>::type> >::type> > orders;
+  typedef typename CompChain<w, orders>::type type;
+};
+
+// Does the COMP list at cp have the component types of L?
+template <class L> static bool matchComps(const U8* cp) {
+  return cp[0]==L::type && matchComps<typename L::next>(cp+compsize[cp[0]]);
+}
+template <> bool matchComps<CompEnd>(const U8* cp) {
+  return cp[0]==NONE;
+}
+
+// Predict components i... in list L with parameters at cp
+template <class L>
+FORCE_INLINE void Predictor::predictList(int i, const U8* cp) {
+  predictComp<L::type>(i, cp);
+  predictList<typename L::next>(i+1, cp+compsize[L::type]);
+}
+template <> inline void Predictor::predictList<CompEnd>(int, const U8*) {}
+
+// Update components i... in list L with parameters at cp
+template <class L>
+FORCE_INLINE void Predictor::updateList(int i, const U8* cp, int y) {
+  updateComp<L::type>(i, cp, y);
+  updateList<typename L::next>(i+1, cp+compsize[L::type], y);
+}
+template <>
+inline void Predictor::updateList<CompEnd>(int, const U8*, int) {}
+
+// predict0() for a model with component list L
+template <class L> int Predictor::predictK() {
+  assert(initTables);
+  assert(c8>=1 && c8<=255);
+  assert(z.header[6]==L::size);
+  predictList<L>(0, &z.header[7]);
+  return squash(p[L::size-1]);
+}
+
+// update0() for a model with component list L
+template <class L> void Predictor::updateK(int y) {
+  assert(initTables);
+  assert(y==0 || y==1);
+  assert(hmap4>=1 && hmap4<=511);
+  updateList<L>(0, &z.header[7], y);
+  updateContext(y);
+}
+
+// Use the kernels for list L if they match the model. Return true if so.
+template <class L> bool Predictor::useKernel() {
+  if (z.header[6]!=L::size || !matchComps<L>(&z.header[7])) return false;
+  predictk=&Predictor::predictK<L>;
+  updatek=&Predictor::updateK<L>;
+  return true;
+}
+
+// Select a specialized predictor for the model in z if there is one
+void Predictor::findKernel() {
+  predictk=0;
+  updatek=0;
+  useKernel<ModelC>() || useKernel<ModelCI>()
+  || useKernel<ModelL4>() || useKernel<ModelL4W>()
+  || useKernel<ModelL5<1, 0>::type>() || useKernel<ModelL5<2, 0>::type>()
+  || useKernel<ModelL5<1, 1>::type>() || useKernel<ModelL5<2, 1>::type>()
+  || useKernel<ModelL5<1, 2>::type>() || useKernel<ModelL5<2, 2>::type>()
+  || useKernel<ModelL5<1, 3>::type>() || useKernel<ModelL5<2, 3>::type>()
+  || useKernel<ModelL5<1, 4>::type>() || useKernel<ModelL5<2, 4>::type>();
+}
+
+#else
+
+void Predictor::findKernel() {
+  predictk=0;
+  updatek=0;
 }
 
+#endif // ifdef NOJIT
+
 // Find cxt row in hash table ht. ht has rows of 16 indexed by the
 // low sizebits of cxt with element 0 having the next higher 8 bits for
 // collision detection. If not found after 3 adjacent tries, replace the
@@ -2853,9 +3951,46 @@ void Compressor::startBlock(const char* hcomp) {
   state=BLOCK1;
 }
 
+// Copy n bytes of p to a
+static void save(Array<char>& a, const char* p, size_t n) {
+  a.resize(n);
+  if (n) memcpy(&a[0], p, n);
+}
+
+// Compile config with args into z and pz, unless they are the same as
+// in the last call, in which case reload the saved result. Either way,
+// write the preprocessor command to pcomp_cmd if not 0.
 void Compressor::startBlock(const char* config, int* args, Writer* pcomp_cmd) {
   assert(state==INIT);
-  Compiler(config, args, z, pz, pcomp_cmd);
+  const size_t len=strlen(config)+1;
+  StringBuffer key(len+36);
+  key.write(config, len);
+  for (int i=0; i<9; ++i) {
+    const int a=args ? args[i] : 0;
+    key.write((const char*)&a, sizeof(a));
+  }
+  if (last.size()==key.size() && !memcmp(&last[0], key.c_str(), key.size())) {
+    MemoryReader mh(&lastHcomp[0]);
+    z.read(&mh);
+    if (lastPcomp.size()) {
+      MemoryReader mp(&lastPcomp[0]);
+      pz.read(&mp);
+    }
+    else
+      pz.clear();
+  }
+  else {
+    StringBuffer cmd, hbuf, pbuf;
+    Compiler(config, args, z, pz, &cmd);
+    z.write(&hbuf, false);
+    if (pz.hend>pz.hbegin) pz.write(&pbuf, false);
+    save(last, key.c_str(), key.size());
+    save(lastHcomp, hbuf.c_str(), hbuf.size());
+    save(lastPcomp, pbuf.c_str(), pbuf.size());
+    save(lastCmd, cmd.c_str(), cmd.size());
+  }
+  if (pcomp_cmd && lastCmd.size())
+    pcomp_cmd->write(&lastCmd[0], lastCmd.size());
   pz.sha1=&sha1;
   assert(z.header.isize()>6);
   enc.out->put('z');
@@ -4586,8 +5721,10 @@ int Predictor::assemble_p() {
 
 // Return a prediction of the next bit in range 0..32767
 // Use JIT code starting at pcode[0] if available, or else create it.
+// With NOJIT, use the kernel chosen by findKernel() if any.
 int Predictor::predict() {
 #ifdef NOJIT
+  if (predictk) return (this->*predictk)();
   return predict0();
 #else
   if (!pcode) {
@@ -4606,32 +5743,25 @@ int Predictor::predict() {
 }
 
 // Update the model with bit y = 0..1
-// Use the JIT code starting at pcode[5].
+// Use the JIT code starting at pcode[5], or with NOJIT, the kernel if any.
 void Predictor::update(int y) {
 #ifdef NOJIT
-  update0(y);
+  if (updatek) (this->*updatek)(y);
+  else update0(y);
 #else
   assert(pcode && pcode[5]);
   ((void(*)(Predictor*, int))&pcode[5])(this, y);
-
-  // Save bit y in c8, hmap4 (not implemented in JIT)
-  c8+=c8+y;
-  if (c8>=256) {
-    z.run(c8-256);
-    hmap4=1;
-    c8=1;
-    for (int i=0; i<z.header[6]; ++i) h[i]=z.H(i);
-  }
-  else if (c8>=16 && c8<32)
-    hmap4=(hmap4&0xf)<<5|y<<4|1;
-  else
-    hmap4=(hmap4&0x1f0)|(((hmap4&0xf)*2+y)&0xf);
+  updateContext(y);  // not implemented in JIT
 #endif
 }
 
 // Execute the ZPAQL code with input byte or -1 for EOF.
 // Use JIT code at rcode if available, or else create it.
 void ZPAQL::run(U32 input) {
+  if (native) {
+    runNative(input);
+    return;
+  }
 #ifdef NOJIT
   run0(input);
 #else
@@ -6071,12 +7201,75 @@ trsort(int *ISA, int *SA, int n, int depth) {
 
 /*---------------------------------------------------------------------------*/
 
+/* Blocks of at least this size sort type B* substrings in parallel
+   if divsufsort() is called with threads > 1. */
+#define SS_PARALLEL_MIN (1 << 20)
+
+/* The buckets of type B* substrings in SA[first..last-1] to be
+   sorted by sssort, divided among threads by size. Each thread has
+   its own part of the work buffer. The buckets are disjoint, so the
+   result is the same as sorting them in sequence. */
+struct SSJob {
+  const unsigned char *T;
+  const int *PAb;
+  int *SA, *buf;
+  int bufsize, n, m;
+  std::vector<int> first, last, thread;
+};
+
+static
+void
+sssort_thread(void *arg, int t) {
+  SSJob& job = *(SSJob *)arg;
+  for(unsigned b = 0; b < job.first.size(); ++b) {
+    if(job.thread[b] == t) {
+      sssort(job.T, job.PAb, job.SA + job.first[b], job.SA + job.last[b],
+             job.buf + t * job.bufsize, job.bufsize, 2, job.n,
+             job.SA[job.first[b]] == (job.m - 1));
+    }
+  }
+}
+
+/* Sort all B* buckets of more than one suffix in SA[0..m-1] using
+   threads, giving each bucket, largest first, to the thread with the
+   least total size so far. */
+static
+void
+sssort_parallel(const unsigned char *T, const int *PAb, int *SA,
+                int *buf, int bufsize, const int *bucket_B,
+                int n, int m, int threads) {
+  SSJob job;
+  int c0, c1, i, j;
+  job.T = T, job.PAb = PAb, job.SA = SA, job.buf = buf;
+  job.bufsize = bufsize / threads, job.n = n, job.m = m;
+  for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
+    for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
+      i = BUCKET_BSTAR(c0, c1);
+      if(1 < (j - i)) { job.first.push_back(i), job.last.push_back(j); }
+    }
+  }
+  std::vector<std::pair<int, int> > order(job.first.size());
+  for(unsigned b = 0; b < order.size(); ++b) {
+    order[b] = std::make_pair(job.first[b] - job.last[b], b);
+  }
+  std::sort(order.begin(), order.end());
+  std::vector<double> load(threads);
+  job.thread.resize(order.size());
+  for(unsigned b = 0; b < order.size(); ++b) {
+    int t = 0;
+    for(int k = 1; k < threads; ++k) { if(load[k] < load[t]) { t = k; } }
+    job.thread[order[b].second] = t;
+    load[t] -= order[b].first;
+  }
+  runThreads(sssort_thread, &job, threads);
+}
+
 /* Sorts suffixes of type B*. */
 static
 int
 sort_typeBstar(const unsigned char *T, int *SA,
                int *bucket_A, int *bucket_B,
-               int n) {
+               int n, int threads) {
   int *PAb, *ISAb, *buf;
 #ifdef _OPENMP
   int *curbuf;
@@ -6170,12 +7363,16 @@ note:
     }
 #else
     buf = SA + m, bufsize = n - (2 * m);
-    for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
-      for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
-        i = BUCKET_BSTAR(c0, c1);
-        if(1 < (j - i)) {
-          sssort(T, PAb, SA + i, SA + j,
-                 buf, bufsize, 2, n, *(SA + i) == (m - 1));
+    if((1 < threads) && (SS_PARALLEL_MIN <= n)) {
+      sssort_parallel(T, PAb, SA, buf, bufsize, bucket_B, n, m, threads);
+    } else {
+      for(c0 = ALPHABET_SIZE - 2, j = m; 0 < j; --c0) {
+        for(c1 = ALPHABET_SIZE - 1; c0 < c1; j = i, --c1) {
+          i = BUCKET_BSTAR(c0, c1);
+          if(1 < (j - i)) {
+            sssort(T, PAb, SA + i, SA + j,
+                   buf, bufsize, 2, n, *(SA + i) == (m - 1));
+          }
         }
       }
     }
@@ -6368,7 +7565,7 @@ construct_BWT(const unsigned char *T, int *SA,
 /*- Function -*/
 
 int
-divsufsort(const unsigned char *T, int *SA, int n) {
+divsufsort(const unsigned char *T, int *SA, int n, int threads) {
   int *bucket_A, *bucket_B;
   int m;
   int err = 0;
@@ -6384,7 +7581,7 @@ divsufsort(const unsigned char *T, int *SA, int n) {
 
   /* Suffixsort. */
   if((bucket_A != NULL) && (bucket_B != NULL)) {
-    m = sort_typeBstar(T, SA, bucket_A, bucket_B, n);
+    m = sort_typeBstar(T, SA, bucket_A, bucket_B, n, threads);
     construct_SA(T, SA, bucket_A, bucket_B, n, m);
   } else {
     err = -2;
@@ -6412,7 +7609,7 @@ divbwt(const unsigned char *T, unsigned char *U, int *A, int n) {
 
   /* Burrows-Wheeler Transform. */
   if((B != NULL) && (bucket_A != NULL) && (bucket_B != NULL)) {
-    m = sort_typeBstar(T, B, bucket_A, bucket_B, n);
+    m = sort_typeBstar(T, B, bucket_A, bucket_B, n, 1);
     pidx = construct_BWT(T, B, bucket_A, bucket_B, n, m);
 
     /* Copy to output string. */
@@ -6433,6 +7630,283 @@ divbwt(const unsigned char *T, unsigned char *U, int *A, int n) {
 
 // End divsufsort.c
 
+/////////////////////////// lowMemoryBWT /////////////////////////////
+
+// SA-IS (Nong, Zhang, and Chan, 2009) for an integer string s[0..n-1]
+// with values 0..K where s[n-1]=0 is unique. Computes SA[0..n-1].
+
+// Set bkt[c] to the start (or end if end) of the bucket of each c in s
+static void saisBuckets(const int* s, int* bkt, int n, int K, bool end) {
+  for (int c=0; c<=K; ++c) bkt[c]=0;
+  for (int i=0; i<n; ++i) ++bkt[s[i]];
+  for (int c=0, sum=0; c<=K; ++c) {
+    sum+=bkt[c];
+    bkt[c]=end ? sum : sum-bkt[c];
+  }
+}
+
+// Induce the order of L type suffixes and then S type suffixes.
+// t[i] is 1 if suffix i is S type.
+static void saisInduce(const int* s, int* SA, const unsigned char* t,
+                       int* bkt, int n, int K) {
+  saisBuckets(s, bkt, n, K, false);
+  for (int i=0; i<n; ++i) {
+    const int j=SA[i]-1;
+    if (j>=0 && !t[j]) SA[bkt[s[j]]++]=j;
+  }
+  saisBuckets(s, bkt, n, K, true);
+  for (int i=n-1; i>=0; --i) {
+    const int j=SA[i]-1;
+    if (j>=0 && t[j]) SA[--bkt[s[j]]]=j;
+  }
+}
+
+static void sais(const int* s, int* SA, int n, int K) {
+  assert(n>=2 && s[n-1]==0);
+  Array<unsigned char> t(n);
+  std::vector<int> bkt(K+1);
+  t[n-1]=1;
+  t[n-2]=0;
+  for (int i=n-3; i>=0; --i)
+    t[i]=s[i]<s[i+1] || (s[i]==s[i+1] && t[i+1]);
+#define isLMS(i) ((i)>0 && t[i] && !t[(i)-1])
+
+  // Sort the LMS substrings
+  saisBuckets(s, &bkt[0], n, K, true);
+  for (int i=0; i<n; ++i) SA[i]=-1;
+  for (int i=1; i<n; ++i)
+    if (isLMS(i)) SA[--bkt[s[i]]]=i;
+  saisInduce(s, SA, &t[0], &bkt[0], n, K);
+
+  // Name them in SA[n1..n-1] and move the names to the end
+  int n1=0;
+  for (int i=0; i<n; ++i)
+    if (isLMS(SA[i])) SA[n1++]=SA[i];
+  for (int i=n1; i<n; ++i) SA[i]=-1;
+  int name=0, prev=-1;
+  for (int i=0; i<n1; ++i) {
+    const int pos=SA[i];
+    bool diff=false;
+    for (int d=0; d<n; ++d) {
+      if (prev<0 || s[pos+d]!=s[prev+d] || t[pos+d]!=t[prev+d]) {
+        diff=true;
+        break;
+      }
+      else if (d>0 && (isLMS(pos+d) || isLMS(prev+d)))
+        break;
+    }
+    if (diff) ++name, prev=pos;
+    SA[n1+pos/2]=name-1;
+  }
+  for (int i=n-1, j=n-1; i>=n1; --i)
+    if (SA[i]>=0) SA[j--]=SA[i];
+
+  // Sort the LMS suffixes, recursively if their names are not unique
+  int* s1=SA+n-n1;
+  if (name<n1) sais(s1, SA, n1, name-1);
+  else for (int i=0; i<n1; ++i) SA[s1[i]]=i;
+
+  // Induce the order of all suffixes from the LMS suffixes
+  saisBuckets(s, &bkt[0], n, K, true);
+  for (int i=1, j=0; i<n; ++i)
+    if (isLMS(i)) s1[j++]=i;
+  for (int i=0; i<n1; ++i) SA[i]=s1[SA[i]];
+  for (int i=n1; i<n; ++i) SA[i]=-1;
+  for (int i=n1-1; i>=0; --i) {
+    const int j=SA[i];
+    SA[i]=-1;
+    SA[--bkt[s[j]]]=j;
+  }
+  saisInduce(s, SA, &t[0], &bkt[0], n, K);
+#undef isLMS
+}
+
+// Computes lcp(T[t..e-1], P[0..len-1]) for increasing t using
+// the Z array of P, where Z[k] = lcp(P[k..len-1], P).
+class PrefixMatcher {
+  const unsigned char* T;
+  const unsigned char* P;
+  const int* Z;
+  unsigned len, e;
+  unsigned l, r;  // T[l..r-1] = P[0..r-l-1]
+public:
+  PrefixMatcher(const unsigned char* T_, unsigned e_,
+                const unsigned char* P_, unsigned len_, int* Z_);
+  unsigned next(unsigned t) {
+    unsigned x=0;
+    if (t<r) {
+      const unsigned z=Z[t-l];
+      if (z<r-t) return z;
+      x=r-t;
+    }
+    while (t+x<e && x<len && T[t+x]==P[x]) ++x;
+    l=t, r=t+x;
+    return x;
+  }
+};
+
+// Compute Z_[0..len_-1]
+PrefixMatcher::PrefixMatcher(const unsigned char* T_, unsigned e_,
+    const unsigned char* P_, unsigned len_, int* Z_):
+    T(T_), P(P_), Z(Z_), len(len_), e(e_), l(0), r(0) {
+  if (len<1) return;
+  Z_[0]=len;
+  for (unsigned k=1, zl=0, zr=0; k<len; ++k) {
+    unsigned z=0;
+    if (k<zr) z=std::min(zr-k, unsigned(Z_[k-zl]));
+    while (k+z<len && P[z]==P[k+z]) ++z;
+    Z_[k]=z;
+    if (k+z>zr) zl=k, zr=k+z;
+  }
+}
+
+// Counts of each byte value in a BWT L[0..n-1] to compute rank(c, x),
+// the number of c in L[0..x-1]. Counts are saved every K bytes, as 16
+// bits relative to counts saved every 64K bytes.
+class BWTRank {
+  enum {K=1<<10, K2=1<<16};
+  const unsigned char* L;
+  unsigned n;
+  std::vector<unsigned> occ2;   // count of c in L[0..i*K2-1] at i*256+c
+  std::vector<U16> occ;         // same for i*K minus occ2 at i*256+c
+  unsigned count(int c, unsigned i) const {  // rank(c, i*K)
+    return occ2[(i/(K2/K))*256+c]+occ[i*256+c];
+  }
+public:
+  BWTRank(const unsigned char* L_): L(L_), n(0) {}
+  void build(unsigned n_);
+  unsigned rank(int c, unsigned x) const {
+    assert(x<=n);
+    const unsigned i=x/K;
+    unsigned r=0;
+    if (x%K<K/2 || (i+1)*K>n) {
+      for (unsigned j=i*K; j<x; ++j) r+=L[j]==c;
+      return count(c, i)+r;
+    }
+    for (unsigned j=x; j<(i+1)*K; ++j) r+=L[j]==c;
+    return count(c, i+1)-r;
+  }
+};
+
+// Count L[0..n_-1]
+void BWTRank::build(unsigned n_) {
+  n=n_;
+  occ.resize((n/K+1)*256);
+  occ2.resize((n/K2+1)*256);
+  unsigned total[256]={0};  // counts of L[0..i*K-1]
+  for (unsigned i=0; i<=n/K; ++i) {
+    if (i%(K2/K)==0) memcpy(&occ2[i/(K2/K)*256], total, sizeof(total));
+    for (int c=0; c<256; ++c)
+      occ[i*256+c]=total[c]-occ2[i/(K2/K)*256+c];
+    for (unsigned j=i*K; j<(i+1)*K && j<n; ++j) ++total[L[j]];
+  }
+}
+
+// Return the block size used by lowMemoryBWT(T, n)
+static unsigned lowMemoryBlock(unsigned n) {
+  return std::max(n/16, std::min(n, 1u<<20));
+}
+
+// Return the memory used by lowMemoryBWT(T, n, L) except T and L
+static double lowMemoryBWTMemory(double n) {
+  return n/8+n/2+9.0*lowMemoryBlock(unsigned(n));
+}
+
+// Write the BWT of T[0..n-1] to L[0..n] as LZBuffer::fill() outputs it
+// and return the index. The text is sorted in blocks from the end as in
+// Ferragina, Gagie, and Manzini, "Lightweight Data Indexing and
+// Compression in External Memory", 2012. Each block is suffix sorted by
+// sais() with comparisons past its end decided by bits gt[i] = (suffix i
+// > suffix s) where s is the start of the previous block. The suffixes
+// of the block are then merged into L by backward search. Memory is
+// about n/2 for rank and n/8 for gt, plus 9 bytes per byte of block,
+// instead of 4n for a suffix array.
+static unsigned lowMemoryBWT(const unsigned char* T, unsigned n,
+                             unsigned char* L) {
+  const unsigned M=lowMemoryBlock(n);
+  Array<unsigned char> gt(n/8+1);  // bit i = suffix i > suffix s
+  Array<int> X(M+2), SA(M+2);      // block to sort, suffix array
+  BWTRank rk(L);
+  unsigned cnt[256]={0};  // counts of T[s..n-1]
+  unsigned s=n;           // start of sorted suffixes
+  unsigned pos0=0;        // rank of suffix s in L
+  unsigned N=1;           // number of sorted suffixes, n-s+1
+  L[0]=n>0 ? T[n-1] : 255;
+#define GT(i) ((gt[(i)>>3]>>((i)&7))&1)
+#define SETGT(i, b) (gt[(i)>>3]=(gt[(i)>>3]&~(1<<((i)&7)))|((b)<<((i)&7)))
+  rk.build(N);
+  while (s>0) {
+    const unsigned m=std::min(M, s);
+    const unsigned s2=s-m;  // sort T[s2..s-1]
+
+    // Encode the block with comparison to suffix s. Characters equal to
+    // T[s] code gt, and E codes suffix s after the end of the block.
+    const unsigned plen=std::min(m, n-s);
+    const int t0=s<n ? T[s] : -1;
+    const int E=t0+2;
+    PrefixMatcher pm(T, s, T+s, plen, &SA[0]);
+    for (unsigned p=s2; p<s; ++p) {
+      const unsigned l=pm.next(p);
+      int g;
+      if (l<s-p && l<plen) g=T[p+l]>T[s+l];
+      else if (l==plen && plen==n-s) g=1;
+      else g=!GT(2*s-p);
+      const int c=T[p];
+      X[p-s2]=c<t0 ? c+1 : c==t0 ? t0+1+2*g : c+3;
+    }
+    X[m]=E;
+    X[m+1]=0;
+    sais(&X[0], &SA[0], m+2, 258);
+
+    // Keep the block suffixes in sorted order in SA[0..m-1]
+    unsigned k=0;
+    for (unsigned q=0; q<m+2; ++q)
+      if (unsigned(SA[q])<m) SA[k++]=SA[q];
+    assert(k==m);
+
+    // Count old suffixes less than each block suffix in X by backward
+    // search. Suffix s-1 is not old, so don't count its char at pos0.
+    unsigned C[256];
+    for (int c=0, sum=1; c<256; ++c) C[c]=sum, sum+=cnt[c];
+    const int c0=T[s-1];
+    for (unsigned p=s, g=pos0; p>s2; --p) {
+      const int c=T[p-1];
+      g=C[c]+rk.rank(c, g)-(c==c0 && g>pos0);
+      X[p-1-s2]=g;
+    }
+
+    // Merge block suffixes into L from the back. X becomes rank in L.
+    unsigned w=N+m, o=N;
+    for (unsigned q=m; q-->0;) {
+      const unsigned p=SA[q]+s2;
+      const unsigned r=X[p-s2]+q;
+      while (w>r+1) L[--w]=L[--o];
+      L[--w]=p>0 ? T[p-1] : 255;
+      X[p-s2]=r;
+    }
+    assert(w==o);
+    N+=m;
+    pos0=X[0];
+
+    // Update gt for suffix s2
+    for (unsigned p=s2; p<s; ++p) SETGT(p, unsigned(X[p-s2])>pos0);
+    PrefixMatcher pm2(T, n, T+s2, m, &SA[0]);
+    for (unsigned t=s; t<n; ++t) {
+      const unsigned l=pm2.next(t);
+      if (l<m && t+l<n) SETGT(t, T[t+l]>T[s2+l]);
+      else if (l<m) SETGT(t, 0);
+      else SETGT(t, GT(t+m));
+    }
+    for (unsigned p=s2; p<s; ++p) ++cnt[T[p]];
+    s=s2;
+    rk.build(N);
+  }
+#undef GT
+#undef SETGT
+  assert(N==n+1);
+  return pos0;
+}
+
 /////////////////////////////// add ///////////////////////////////////
 
 // Convert non-negative decimal number x to string of at least n digits
@@ -6466,9 +7940,17 @@ void e8e9(unsigned char* buf, int n) {
 // args[4] is the log2 hash bucket size (number of searches).
 // args[5] is the log2 hash table size. If 21+args[0] then use a suffix array.
 // args[6] is the secondary context look ahead
+// args[7] is 1 to choose matches by optimal parsing instead of greedily.
+//   Then a hash table is searched by hash chains instead of buckets,
+//   and args[3] and args[6] are ignored.
 // sap is pointer to external suffix array of inbuf or 0. If supplied and
 //   args[0]=5..7 then it is assumed that E8E9 was already applied to
 //   both the input and sap and the input buffer is not modified.
+// threads is the number of threads that may be used to build the
+//   suffix array. The result does not depend on it.
+// If lowmem then a BWT is built by lowMemoryBWT(), and an LZ77 suffix
+//   array covers only the 2 ISA windows up to the current one, so that
+//   matches are found only within that range.
 
 class LZBuffer: public libzpaq::Reader {
   libzpaq::Array<unsigned> ht;// hash table, confirm in low bits, or SA+ISA
@@ -6494,12 +7976,44 @@ class LZBuffer: public libzpaq::Reader {
   unsigned idx;               // BWT index
   const unsigned* sa;         // suffix array for BWT or LZ77-SA
   unsigned* isa;              // inverse suffix array for LZ77-SA
+  unsigned isaseg;            // start of the window in isa, or 1 if none
+  unsigned sabase, sasize;    // sa sorts in[sabase..sabase+sasize-1]
+  const bool window;          // LZ77-SA sa covers 2 ISA windows
+  const int threads;          // to sort windows
+  Array<unsigned char> bwt;   // low memory BWT output
   enum {BUFSIZE=1<<14};       // output buffer size
   unsigned char buf[BUFSIZE]; // output buffer
 
+  // Optimal parsing finds the cheapest coding of in[i..i+CHUNK-1].
+  // node[k] has the cheapest coding of in[i..i+k-1] ending in
+  // state s=0 (a literal) or s=1 (a match). The code for the length
+  // of a literal sequence is not counted until it ends.
+  struct Node {
+    unsigned cost[2];   // in bits by end state
+    U8 from[2];         // state of the previous node by end state
+    U8 nexts;           // end state at next
+    unsigned lit;       // pending literals in state 0
+    unsigned len, off;  // match in state 1
+    unsigned next;      // k of the next node in the chosen path
+  };
+  enum {CHUNK=1<<11, NICE=64};  // parse size, match length to take
+  const bool optimal;         // parse optimally?
+  Array<unsigned> chain;      // previous position+1 with the same hash
+  Array<Node> node;           // [0..CHUNK+maxMatch]
+  Array<U64> cand;            // matches found at one position, off<<32|len
+
   void write_literal(unsigned i, unsigned& lit);
   void write_match(unsigned len, unsigned off);
   void fill();  // encode to buf
+  void sortWindow(unsigned pos);  // sort the window for pos, build ISA
+  void buildISA(unsigned pos);  // make isa cover the window of pos
+  void fillISA(unsigned begin, unsigned end);  // from sa[begin..end-1]
+  static void isaThread(void* arg, int t);  // fillISA() part t
+  void parse(unsigned& lit);  // optimally code in[i..] to buf
+  int findMatches(unsigned j);  // list matches at j in cand, return count
+  unsigned insertHash(unsigned j);  // add j to hash chains
+  unsigned literalBits(unsigned lit) const;  // literal code length
+  unsigned matchBits(unsigned len, unsigned off) const;  // match code length
 
   // write k bits of x
   void putb(unsigned x, int k) {
@@ -6526,7 +8040,8 @@ class LZBuffer: public libzpaq::Reader {
   }
 
 public:
-  LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap=0);
+  LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap=0,
+           int threads=1, bool lowmem=false);
 
   // return 1 byte of compressed output (overrides Reader)
   int get() {
@@ -6573,6 +8088,47 @@ int lg(unsigned x) {
     "\x00\x01\x02\x02\x03\x03\x03\x03\x04\x04\x04\x04\x04\x04\x04\x04"[x]+r;
 }
 
+// Return the number of leading bytes of a and b that match, up to max.
+// Compare the first 8 bytes as one word to reject short matches, then
+// 32 or 16 bytes at a time, and find the first difference by counting
+// trailing zero bits.
+static inline unsigned matchLength(const unsigned char* a,
+                                   const unsigned char* b, unsigned max) {
+  unsigned l=0;
+#if defined(__GNUC__) && __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+  U64 x, y;
+  if (max>=8) {
+    memcpy(&x, a, 8);
+    memcpy(&y, b, 8);
+    if (x!=y) return __builtin_ctzll(x^y)>>3;
+    l=8;
+  }
+#if defined(X86SIMD) && defined(__AVX2__)
+  for (; l+32<=max; l+=32) {
+    const unsigned m=~_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i*)(a+l)),
+        _mm256_loadu_si256((const __m256i*)(b+l))));
+    if (m) return l+__builtin_ctz(m);
+  }
+#endif
+#if defined(X86SIMD) && defined(__SSE2__)
+  for (; l+16<=max; l+=16) {
+    const unsigned m=0xffff^_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i*)(a+l)),
+        _mm_loadu_si128((const __m128i*)(b+l))));
+    if (m) return l+__builtin_ctz(m);
+  }
+#endif
+  for (; l+8<=max; l+=8) {
+    memcpy(&x, a+l, 8);
+    memcpy(&y, b+l, 8);
+    if (x!=y) return l+(__builtin_ctzll(x^y)>>3);
+  }
+#endif
+  for (; l<max && a[l]==b[l]; ++l);
+  return l;
+}
+
 // return number of 1 bits in x
 int nbits(unsigned x) {
   int r;
@@ -6593,9 +8149,12 @@ int LZBuffer::read(char* p, int n) {
   return nr;
 }
 
-LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap):
-    ht((args[1]&3)==3 ? (inbuf.size()+1)*!sap      // for BWT suffix array
+LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap,
+                   int threads_, bool lowmem):
+    ht((args[1]&3)==3 ? (inbuf.size()+1)*!(sap || lowmem)  // for BWT SA
         : args[5]-args[0]<21 ? 1u<<args[5]         // for LZ77 hash table
+        : lowmem && !sap ? std::min(inbuf.size(), size_t(2u<<17<<args[0]))
+                           +(1u<<17<<args[0])      // for windowed SA and ISA
         : (inbuf.size()*!sap)+(1u<<17<<args[0])),  // for LZ77 SA and ISA
     in(inbuf.data()),
     checkbits(args[5]-args[0]<21 ? 12-args[0] : 17+args[0]),
@@ -6615,7 +8174,10 @@ LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap):
     minMatchBoth(MAX(minMatch, minMatch2+lookahead)+4),
     rb(args[0]>4 ? args[0]-4 : 0),
     bits(0), nbits(0), rpos(0), wpos(0),
-    idx(0), sa(0), isa(0) {
+    idx(0), sa(0), isa(0), isaseg(1), sabase(0), sasize(inbuf.size()),
+    window(lowmem && !sap && (args[1]&3)<3 && args[5]-args[0]>=21),
+    threads(threads_),
+    optimal(args[7]>0 && level<3) {
   assert(args[0]>=0);
   assert(n<=(1u<<20<<args[0]));
   assert(args[1]>=1 && args[1]<=7 && args[1]!=4);
@@ -6630,17 +8192,83 @@ LZBuffer::LZBuffer(StringBuffer& inbuf, int args[], const unsigned* sap):
   if (args[5]-args[0]>=21 || level==3) {  // LZ77-SA or BWT
     if (sap)
       sa=sap;
+    else if (level==3 && lowmem) {
+      bwt.resize(n+1);
+      bwt[0]=255;
+      if (n>0) idx=lowMemoryBWT(in, n, &bwt[0]);
+    }
+    else if (window) {
+      sa=&ht[0];
+      isa=&ht[ht.size()-(1u<<17<<args[0])];
+      sasize=0;
+      if (n>0) sortWindow(0);
+    }
     else {
       assert(ht.size()>=n);
       assert(ht.size()>0);
       sa=&ht[0];
-      if (n>0) divsufsort((const unsigned char*)in, (int*)sa, n);
+      if (n>0) divsufsort((const unsigned char*)in, (int*)sa, n, threads);
     }
-    if (level<3) {
+    if (level<3 && !window) {
       assert(ht.size()>=(n*(sap==0))+(1u<<17<<args[0]));
       isa=&ht[n*(sap==0)];
     }
   }
+
+  // allocate optimal parsing state
+  if (optimal) {
+    if (!isa) chain.resize(1u<<std::min(args[5], lg(n)));
+    node.resize(CHUNK+maxMatch+1);
+    cand.resize(2*bucket+2);
+  }
+}
+
+// Sort in[sabase..sabase+sasize-1], the ISA window containing pos and the
+// window before it, into ht, and build the ISA for the window of pos.
+void LZBuffer::sortWindow(unsigned pos) {
+  assert(window);
+  const unsigned w=1u<<checkbits;
+  const unsigned seg=pos&~(w-1);
+  sabase=seg>=w ? seg-w : 0;
+  sasize=std::min(n-seg, w)+(seg-sabase);
+  assert(sasize<=ht.size()-w);
+  divsufsort(in+sabase, (int*)&ht[0], sasize, threads);
+  for (unsigned j=0; j<sasize; ++j) {
+    ht[j]+=sabase;
+    if (ht[j]>=seg) isa[ht[j]&(w-1)]=j;
+  }
+  isaseg=seg;
+}
+
+// Set isa[p&mask]=j for sa[j]=p in the window isaseg, j=begin..end-1
+void LZBuffer::fillISA(unsigned begin, unsigned end) {
+  const unsigned mask=(1u<<checkbits)-1;
+  for (unsigned j=begin; j<end; ++j)
+    if ((sa[j]&~mask)==isaseg)
+      isa[sa[j]&mask]=j;
+}
+
+// Fill part t of threads equal parts of isa
+void LZBuffer::isaThread(void* arg, int t) {
+  LZBuffer& lz=*(LZBuffer*)arg;
+  lz.fillISA(U64(lz.sasize)*t/lz.threads, U64(lz.sasize)*(t+1)/lz.threads);
+}
+
+// Make isa cover the window containing pos. Sort a new window, or else
+// scan all of sa once per window, in parallel for large blocks.
+void LZBuffer::buildISA(unsigned pos) {
+  assert(isa);
+  const unsigned seg=pos&~((1u<<checkbits)-1);
+  if (seg==isaseg) return;
+  if (window)
+    sortWindow(pos);
+  else {
+    isaseg=seg;
+    if (threads>1 && sasize>=(1u<<20))
+      runThreads(isaThread, this, threads);
+    else
+      fillISA(0, sasize);
+  }
 }
 
 // Encode from in to buf until end of input or buf is not empty
@@ -6649,10 +8277,11 @@ void LZBuffer::fill() {
   // BWT
   if (level==3) {
     assert(in || n==0);
-    assert(sa);
+    assert(sa || bwt.size()==n+1);
     for (; wpos<BUFSIZE && i<n+5; ++i) {
-      if (i==0) put(n>0 ? in[n-1] : 255);
-      else if (i>n) put(idx&255), idx>>=8;
+      if (i>n) put(idx&255), idx>>=8;
+      else if (bwt.size()) put(bwt[i]);
+      else if (i==0) put(n>0 ? in[n-1] : 255);
       else if (sa[i-1]==0) idx=i, put(255);
       else put(in[sa[i-1]-1]);
     }
@@ -6662,6 +8291,21 @@ void LZBuffer::fill() {
   // LZ77: scan the input
   unsigned lit=0;  // number of output literals pending
   const unsigned mask=(1<<checkbits)-1;
+
+  // Parse optimally one chunk at a time. Leave room in buf for the
+  // pending literals and a chunk of literals or a long match.
+  if (optimal) {
+    while (i<n && wpos*4<BUFSIZE) {
+      parse(lit);
+      if (lit>=maxLiteral || (lit>0 && wpos*4>=BUFSIZE))
+        write_literal(i, lit);
+    }
+    if (i==n) {
+      write_literal(n, lit);
+      flush();
+    }
+    return;
+  }
   while (i<n && wpos*2<BUFSIZE) {
 
     // Search for longest match, or pick closest in case of tie
@@ -6672,21 +8316,17 @@ void LZBuffer::fill() {
 
     // Look up contexts in suffix array
     if (isa) {
-      if (sa[isa[i&mask]]!=i) // rebuild ISA
-        for (unsigned j=0; j<n; ++j)
-          if ((sa[j]&~mask)==(i&~mask))
-            isa[sa[j]&mask]=j;
+      buildISA(i);
       for (unsigned h=0; h<=lookahead; ++h) {
         unsigned q=isa[(h+i)&mask];  // location of h+i in SA
-        assert(q<n);
-        if (sa[q]!=h+i) continue;
+        if (q>=sasize || sa[q]!=h+i) continue;
         for (int j=-1; j<=1; j+=2) {  // search backward and forward
           for (unsigned k=1; k<=bucket; ++k) {
             unsigned p;  // match to be tested
-            if (q+j*k<n && (p=sa[q+j*k]-h)<i) {
+            if (q+j*k<sasize && (p=sa[q+j*k]-h)<i) {
               assert(p<n);
               unsigned l, l1;  // length of match, leading literals
-              for (l=h; i+l<n && l<maxMatch && in[p+l]==in[i+l]; ++l);
+              l=h+matchLength(in+p+h, in+i+h, std::min(n-i, maxMatch)-h);
               for (l1=h; l1>0 && in[p+l1-1]==in[i+l1-1]; --l1);
               int score=int(l-l1)*8-lg(i-p)-4*(lit==0 && l1>0)-11;
               for (unsigned a=0; a<h; ++a) score=score*5/8;
@@ -6710,7 +8350,9 @@ void LZBuffer::fill() {
             p>>=checkbits;
             if (p<i && i+blen<=n && in[p+blen-1]==in[i+blen-1]) {
               unsigned l;  // match length from lookahead
-              for (l=lookahead; i+l<n && l<maxMatch && in[p+l]==in[i+l]; ++l);
+              l=lookahead;
+              if (i+l<n && l<maxMatch)
+                l+=matchLength(in+p+l, in+i+l, std::min(n-i, maxMatch)-l);
               if (l>=minMatch2+lookahead) {
                 int l1;  // length back from lookahead
                 for (l1=lookahead; l1>0 && in[p+l1-1]==in[i+l1-1]; --l1);
@@ -6732,7 +8374,7 @@ void LZBuffer::fill() {
             p>>=checkbits;
             if (p<i && i+blen<=n && in[p+blen-1]==in[i+blen-1]) {
               unsigned l;
-              for (l=0; i+l<n && l<maxMatch && in[p+l]==in[i+l]; ++l);
+              l=matchLength(in+p, in+i, std::min(n-i, maxMatch));
               int score=l*8-lg(i-p)-2*(lit>0)-11;
               if (score>bscore) blen=l, bp=p, blit=0, bscore=score;
             }
@@ -6793,6 +8435,156 @@ void LZBuffer::fill() {
   }
 }
 
+// Return the bits to code lit literals as one sequence, excluding the
+// literals themselves.
+unsigned LZBuffer::literalBits(unsigned lit) const {
+  if (lit==0) return 0;
+  if (level==1) return lg(lit)*2+1;
+  return (lit+63)/64*8;
+}
+
+// Return the bits to code a match as written by write_match()
+unsigned LZBuffer::matchBits(unsigned len, unsigned off) const {
+  if (level==1)
+    return lg(len)*2+1+lg(off+(1<<rb)-1);
+  const unsigned bytes=off<=(1<<16) ? 3 : off<=(1<<24) ? 4 : 6;
+  unsigned r=0;
+  while (len>0) {
+    len-=len>minMatch*2+63 ? minMatch+63 : len>minMatch+63 ? len-minMatch : len;
+    r+=bytes*8;
+  }
+  return r;
+}
+
+// Add in[j..] to the hash chains and return the previous position+1
+// with the same hash of the next 4 bytes, or 0 if none.
+unsigned LZBuffer::insertHash(unsigned j) {
+  assert(!isa && j+minMatch<=n);
+  unsigned h=0;
+  for (unsigned k=0; k<minMatch && k<4; ++k) h=h<<8|in[j+k];
+  h=U64(h*2654435761u)*htsize>>32;
+  assert(h<htsize);
+  const unsigned p=ht[h];
+  ht[h]=j+1;
+  chain(j)=p;
+  return p;
+}
+
+// Put matches to in[j..] in cand as off<<32|len in order of increasing
+// offset and length and return their number. Add j to the hash table.
+int LZBuffer::findMatches(unsigned j) {
+  const unsigned maxl=std::min(maxMatch, n-j);
+  if (maxl<minMatch) return 0;
+  int nc=0;
+
+  // Search the suffix array forward and backward up to bucket places
+  if (isa) {
+    const unsigned mask=(1<<checkbits)-1;
+    buildISA(j);
+    const unsigned q=isa[j&mask];
+    assert(q<sasize && sa[q]==j);
+    for (int d=-1; d<=1; d+=2) {
+      unsigned l=maxl;  // LCP can only decrease away from q
+      unsigned off=j+1;  // closest match so far. Skip farther ones.
+      for (unsigned k=1; k<=bucket && q+d*k<sasize; ++k) {
+        const unsigned p=sa[q+d*k];
+        if (p>=j || j-p>=off) continue;
+        l=matchLength(in+p, in+j, l);
+        if (l<minMatch) break;
+        off=j-p;
+        cand[nc++]=U64(off)<<32|l;
+      }
+    }
+    std::sort(&cand[0], &cand[0]+nc);
+    int k=0;
+    for (int m=0; m<nc; ++m)
+      if (k==0 || unsigned(cand[m])>unsigned(cand[k-1]))
+        cand[k++]=cand[m];
+    return k;
+  }
+
+  // Follow the hash chain up to bucket+1 places
+  unsigned p=insertHash(j);
+  unsigned best=minMatch-1;
+  for (unsigned k=0; p>0 && k<=bucket && j-(p-1)<chain.size(); ++k) {
+    const unsigned q=p-1;
+    if (in[q+best]==in[j+best]) {
+      const unsigned l=matchLength(in+q, in+j, maxl);
+      if (l>best) {
+        cand[nc++]=U64(j-q)<<32|l;
+        best=l;
+        if (l>=NICE || l==maxl) break;
+      }
+    }
+    p=chain(q);
+  }
+  return nc;
+}
+
+// Code in[i..] up to CHUNK bytes or through a match of at least NICE
+// bytes, whichever is cheapest in bits, and advance i. lit is the
+// number of pending literals before i and after.
+void LZBuffer::parse(unsigned& lit) {
+  const unsigned INF=1u<<30;  // cost of an unreachable node
+  const unsigned e=std::min(n, i+CHUNK);
+  unsigned end=e;  // i+ last node
+  for (unsigned k=0; k<=e-i; ++k) node[k].cost[0]=node[k].cost[1]=INF;
+  node[0].cost[0]=0;
+  node[0].lit=lit;
+
+  // Find the cheapest paths to each node in order
+  for (unsigned j=i; j<e; ++j) {
+    const Node& a=node[j-i];
+    Node& b=node[j-i+1];
+    for (int s=0; s<2; ++s) {  // add a literal
+      const unsigned c=a.cost[s]+8;
+      if (c<b.cost[0]) b.cost[0]=c, b.from[0]=s, b.lit=s ? 1 : a.lit+1;
+    }
+    const unsigned c0=a.cost[0]+literalBits(a.lit);  // end literals
+    const int s=a.cost[1]<c0;  // cheaper state to start a match
+    const unsigned base=s ? a.cost[1] : c0;
+    const int nc=findMatches(j);
+    if (nc>0 && unsigned(cand[nc-1])>=NICE) {  // take a long match
+      const unsigned len=unsigned(cand[nc-1]), off=cand[nc-1]>>32;
+      end=j+len;
+      Node& m=node[end-i];
+      m.cost[0]=INF;
+      m.cost[1]=base+matchBits(len, off), m.from[1]=s;
+      m.len=len, m.off=off;
+      if (!isa) while (++j<end && j+minMatch<=n) insertHash(j);
+      break;
+    }
+    unsigned len=minMatch;
+    for (int k=0; k<nc; ++k) {
+      const unsigned off=cand[k]>>32;
+      for (; len<=unsigned(cand[k]) && j+len<=e; ++len) {
+        Node& m=node[j-i+len];
+        const unsigned c=base+matchBits(len, off);
+        if (c<m.cost[1]) m.cost[1]=c, m.from[1]=s, m.len=len, m.off=off;
+      }
+    }
+  }
+
+  // Link the path forward from the end and code it
+  int s=node[end-i].cost[1]<node[end-i].cost[0]+literalBits(node[end-i].lit);
+  for (unsigned k=end-i; k>0;) {
+    const Node& b=node[k];
+    const unsigned k1=s ? k-b.len : k-1;
+    node[k1].next=k;
+    node[k1].nexts=s;
+    s=b.from[s];
+    k=k1;
+  }
+  for (unsigned k=0; k<end-i; k=node[k].next) {
+    if (node[k].nexts==0) ++lit;
+    else {
+      write_literal(i+k, lit);
+      write_match(node[node[k].next].len, node[node[k].next].off);
+    }
+  }
+  i=end;
+}
+
 // Write literal sequence in[i-lit..i-1], set lit=0
 void LZBuffer::write_literal(unsigned i, unsigned& lit) {
   assert(lit>=0);
@@ -6897,7 +8689,7 @@ std::string makeConfig(const char* method, int args[]) {
   args[4]=0;  // log searches
   args[5]=0;  // lz77 hash table size or SA if args[0]+21
   args[6]=0;  // secondary context look ahead
-  args[7]=0;  // not used
+  args[7]=0;  // lz77 optimal parse
   args[8]=0;  // not used
   if (isdigit(*++method)) args[0]=0;
   for (int i=0; i<9 && (isdigit(*method) || *method==',' || *method=='.');) {
@@ -7534,16 +9326,511 @@ std::string makeConfig(const char* method, int args[]) {
   return hdr+itos(ncomp)+"\n"+comp+hcomp+"halt\n"+pcomp;
 }
 
+////////////////////////// Native PCOMPs //////////////////////////
+
+// The PCOMPs generated by makeConfig() are recognized by their byte
+// code when loaded by initp() and run() executes equivalent C++ code
+// instead. It gives the same output and leaves H, M, R, and the registers
+// that are read before being written on the next input in the same state
+// as the ZPAQL code would. A and F are not kept, nor is B by lazy2.
+
+enum {NATIVE_LAZY2=1, NATIVE_LZPRE, NATIVE_BWTRLE, NATIVE_E8E9};
+
+// A standard PCOMP. If argpos>=0 then code[argpos] is an operand
+// that may take any value and is the arg.
+struct NativePCOMP {
+  std::string code;  // byte code between hbegin and hend
+  int type;          // NATIVE_*
+  int arg;           // nativeArg
+  int argpos;        // location of a variable arg in code or -1
+  bool e8;           // nativeE8
+};
+
+// Return the byte code of the PCOMP generated for method
+static std::string pcompCode(const std::string& method) {
+  int args[9]={0};
+  const std::string config=makeConfig(method.c_str(), args);
+  ZPAQL hz, pz;
+  Compiler(config.c_str(), args, hz, pz, 0);
+  return std::string((const char*)&pz.header[pz.hbegin], pz.hend-pz.hbegin);
+}
+
+// Generate all of the PCOMPs that makeConfig() can produce
+static std::vector<NativePCOMP> makeNativePCOMPs() {
+  std::vector<NativePCOMP> v;
+  NativePCOMP p;
+  for (int e8=0; e8<2; ++e8) {
+    p.e8=e8;
+    p.argpos=-1;
+    p.type=NATIVE_LAZY2;
+    for (p.arg=0; p.arg<8; ++p.arg) {  // rb = block size bits - 4
+      p.code=pcompCode("x"+itos(p.arg+4)+"."+itos(1+e8*4));
+      v.push_back(p);
+    }
+    p.type=NATIVE_BWTRLE;
+    for (p.arg=0; p.arg<2; ++p.arg) {  // fast IBWT for blocks up to 16 MB
+      p.code=pcompCode((p.arg ? "x4." : "x5.")+itos(3+e8*4));
+      v.push_back(p);
+    }
+    p.type=NATIVE_LZPRE;  // minimum match length is the operand of a+=
+    p.arg=0;
+    p.code=pcompCode(e8 ? "x0.6.0" : "x0.2.0");
+    const std::string code1=pcompCode(e8 ? "x0.6.1" : "x0.2.1");
+    assert(code1.size()==p.code.size());
+    for (p.argpos=0; p.code[p.argpos]==code1[p.argpos]; ++p.argpos);
+    v.push_back(p);
+  }
+  p.type=NATIVE_E8E9;
+  p.arg=0;
+  p.argpos=-1;
+  p.e8=false;
+  p.code=pcompCode("x0.4");
+  v.push_back(p);
+  return v;
+}
+
+// Set native, nativeArg, and nativeE8 if the PCOMP is a standard one
+void ZPAQL::findNative() {
+  static const std::vector<NativePCOMP> pcomps=makeNativePCOMPs();
+  native=0;
+  const int n=hend-hbegin;
+  for (size_t i=0; i<pcomps.size(); ++i) {
+    const NativePCOMP& p=pcomps[i];
+    if (int(p.code.size())!=n) continue;
+    int j=0;
+    while (j<n && (j==p.argpos || U8(p.code[j])==header[hbegin+j])) ++j;
+    if (j<n) continue;
+    native=p.type;
+    nativeArg=p.argpos>=0 ? header[hbegin+p.argpos] : p.arg;
+    nativeE8=p.e8;
+    return;
+  }
+}
+
+// Run a native PCOMP with input byte or -1 for EOS
+void ZPAQL::runNative(U32 input) {
+  switch (native) {
+    case NATIVE_LAZY2: runLazy2(input); break;
+    case NATIVE_LZPRE: runLzpre(input); break;
+    case NATIVE_BWTRLE: runBwtrle(input); break;
+    case NATIVE_E8E9: runE8e9(input); break;
+    default: err();
+  }
+}
+
+// Output p[0..n-1], flushing at the same points as outc()
+void ZPAQL::outs(const U8* p, size_t n) {
+  while (n>0) {
+    size_t k=outbuf.size()-bufptr;
+    if (k>n) k=n;
+    memcpy(&outbuf[bufptr], p, k);
+    bufptr+=k;
+    p+=k;
+    n-=k;
+    if (bufptr==outbuf.isize()) flush();
+  }
+}
+
+// Copy n bytes from M[C++] to M[B++] one byte at a time, as in
+// "do *b=*c b++ c++ ... while", and output them if out
+void ZPAQL::copyMatch(U64 n, bool out) {
+  const size_t mask=m.size()-1;
+  U8* const p=&m[0];
+  while (n>0) {
+    const size_t i=b&mask, j=c&mask;  // copy up to where either wraps
+    U64 k=mask+1-(i>j ? i : j);
+    if (k>n) k=n;
+    if (i<=j || i-j>=k)
+      memmove(p+i, p+j, k);
+    else  // overlapping: repeat the last i-j bytes
+      for (U64 x=0; x<k; x+=i-j)
+        memcpy(p+i+x, p+j+x, std::min(U64(i-j), k-x));
+    if (out) outs(p+i, k);
+    b+=k;
+    c+=k;
+    n-=k;
+  }
+}
+
+// Inverse E8E9 transform M[0..n-1] in place and output it. Return
+// the position of the last E8 or E9 byte tested, or c if none.
+U32 ZPAQL::unE8e9(U32 n, U32 c) {
+  for (U32 i=0; i!=n; ++i) {
+    if (U32(i+4)<n && (m(i)&254)==232) {
+      c=i;
+      if (((m(i+4)+1)&254)==0) {
+        const U32 x=(m(i+3)<<16|m(i+2)<<8|m(i+1))-i;
+        m(i+1)=x;
+        m(i+2)=x>>8;
+        m(i+3)=x>>16;
+      }
+    }
+    outc(m(i));
+  }
+  return c;
+}
+
+// "pcomp lazy2": decode LZ77 codes with nativeArg low offset bits.
+// R1=state, R2=length, R3=offset bits, R4=output position in M,
+// R5=low offset bits, C=bit buffer, D=bits in C.
+void ZPAQL::runLazy2(U32 input) {
+  const int rb=nativeArg;
+  if (input>255) {  // EOS: inverse E8E9 and reset
+    if (nativeE8) unE8e9(r[4], c);
+    b=c=d=0;
+    r[1]=r[2]=r[3]=r[4]=0;
+    return;
+  }
+  c+=input<<(d&31);
+  d+=8;
+  if (r[1]==0) {  // new code
+    r[2]=1;
+    if (c&3) {  // match
+      r[3]=((c&3)-1)*8+(c>>2&7);
+      c>>=5;
+      d-=5;
+      r[1]=1;
+    }
+    else {  // literal
+      c>>=2;
+      d-=2;
+      r[1]=3;
+    }
+  }
+  while (r[1]==1 && d>2) {  // match length
+    if (c&1) {
+      r[2]+=r[2]+(c>>1&1);
+      c>>=2;
+      d-=2;
+    }
+    else {
+      r[2]=r[2]*4+(c>>1&3);
+      c>>=3;
+      d-=3;
+      r[1]=rb ? 5 : 2;
+    }
+  }
+  if (rb && r[1]==5 && d>U32(rb-1)) {  // low bits of offset
+    r[5]=c&((1<<rb)-1);
+    c>>=rb;
+    d-=rb;
+    r[1]=2;
+  }
+  if (r[1]==2 && r[3]<=d) {  // offset, then copy match
+    const U32 hi=1u<<(r[3]&31);
+    U32 off=((hi-1)&c)+hi;
+    if (rb) off=(off<<rb)+r[5]-((1<<rb)-1);
+    r[6]=c;
+    r[7]=d;
+    b=r[4];
+    c=b-off;
+    copyMatch(r[2], !nativeE8);
+    r[4]=b;
+    c=r[6]>>(r[3]&31);
+    d=r[7]-r[3];
+    r[1]=0;
+  }
+  while (r[1]==3 && d>1) {  // literal length
+    if (c&1) {
+      r[2]+=r[2]+(c>>1&1);
+      c>>=2;
+      d-=2;
+    }
+    else {
+      c>>=1;
+      --d;
+      r[1]=4;
+    }
+  }
+  if (r[1]==4 && d>7) {  // literal
+    m(r[4])=c;
+    if (!nativeE8) outc(c&255);
+    ++r[4];
+    c>>=8;
+    d-=8;
+    if (--r[2]==0) r[1]=0;
+  }
+}
+
+// "pcomp lzpre": decode byte aligned LZ77 with minimum match length
+// nativeArg. D=state, B=output position in M, R1=length, R2=offset.
+void ZPAQL::runLzpre(U32 input) {
+  if (input>255) {  // EOS: inverse E8E9 and reset
+    if (nativeE8) unE8e9(b, c);
+    b=c=d=0;
+    r[1]=r[2]=0;
+    return;
+  }
+  c=input;
+  if (d==0) {  // new code
+    d=(c>>6)+1;
+    r[2]=0;
+    if (d==1) r[1]=c+1;  // literal length
+    else ++d, r[1]=(c&63)+nativeArg;  // match length
+  }
+  else if (d==1) {  // literal
+    m(b)=c;
+    ++b;
+    if (!nativeE8) outc(c);
+    if (--r[1]==0) d=0;
+  }
+  else if (d>2) {  // offset
+    r[2]=r[2]<<8|c;
+    --d;
+  }
+  else {  // last offset byte, copy match
+    c=b-(r[2]<<8|c)-1;
+    copyMatch(r[1] ? r[1] : U64(1)<<32, !nativeE8);
+    d=0;
+  }
+}
+
+// An IBWTWalker reads the output of the list traversal that inverts a
+// BWT in the BWT PCOMP: "d=p do d=next(d) out byte(d) until d==0", where
+// next(d)=H[d]>>8 and byte(d)=H[d]&255 if the list is packed, else
+// next(d)=H[d] and byte(d)=M[d]. Each step is a cache miss. To overlap
+// them, walkers starting at p and at multiples of a power of 2 follow
+// parts of the list in turn. The constructor walks each part to the
+// start of another to find its length and place in the output. Then
+// read() walks the parts again, a window at a time. If the list is
+// small, longer than n, or does not end, then size() is -1 and the
+// caller must traverse the list itself.
+class IBWTWalker {
+public:
+  enum {WINDOW=1<<20};  // suggested read() size
+  IBWTWalker(const U32* h, size_t hmask, const U8* m, size_t mmask,
+             U32 p, U32 n);
+  U32 size() const {return total;}
+  U32 read(U8* buf, U32 n);  // write up to n more bytes, return count
+private:
+  const U32* h;        // list
+  const U8* m;         // bytes or 0 if packed
+  const size_t hmask, mmask;
+  const U32 p;         // start of list
+  U32 step;            // walker i>0 starts at i*step
+  U32 total;           // output size or -1
+  U32 done;            // bytes read
+  U32 started;         // walkers order[0..started-1] in use by read()
+  U32 finished;        // walkers order[0..finished-1] done
+  U32 parts;           // number of walkers in order
+  Array<U32> d;        // walker i position in list
+  Array<U32> pos;      // walker i output position
+  Array<U32> stop;     // walker i end of output
+  Array<U32> order;    // walkers in output order
+  Array<U32> act;      // walkers still going
+  U32 next(U32 x) const {return m ? h[x&hmask] : h[x&hmask]>>8;}
+  U32 byte(U32 x) const {return m ? m[x&mmask] : h[x&hmask]&255;}
+  U32 start(U32 i) const {return i ? i*step : p;}
+};
+
+IBWTWalker::IBWTWalker(const U32* h_, size_t hmask_, const U8* m_,
+    size_t mmask_, U32 p_, U32 n):
+    h(h_), m(m_), hmask(hmask_), mmask(mmask_), p(p_), step(1),
+    total(U32(-1)), done(0), started(0), finished(0), parts(0) {
+  if (n<(1u<<16) || n>=(1u<<31)) return;  // small lists are cached
+  while (n/step>n/(WINDOW/64)+1) step*=2;  // about 64 parts per window
+  const U32 nw=n/step+1;
+  d.resize(nw);
+  pos.resize(nw);
+  stop.resize(nw);
+  order.resize(nw);
+  act.resize(nw);
+
+  // Walk each part to the start of another, saving length in pos
+  // and end in stop
+  U64 steps=0;
+  for (U32 i=0; i<nw; ++i) d[i]=start(i), act[i]=i;
+  for (U32 na=nw; na>0;) {
+    for (U32 i=0; i<na;) {
+      const U32 w=act[i], x=d[w]=next(d[w]);
+      ++pos[w];
+      if (x&(step-1)) ++i;
+      else stop[w]=x, act[i]=act[--na];
+      if (++steps>U64(n)*2+nw) return;
+    }
+  }
+
+  // Link the parts from p in output order, marking them in act
+  for (U32 i=0; i<nw; ++i) act[i]=0;
+  U32 w=0, size=0;
+  while (p) {
+    if (act[w] || pos[w]>n-size) return;
+    act[w]=1;
+    order[parts++]=w;
+    const U32 x=stop[w];
+    stop[w]=size+pos[w];
+    pos[w]=size;
+    size=stop[w];
+    if (x==0) break;
+    w=x/step;
+    if (w>=nw || w*step==p) return;
+  }
+  total=size;
+}
+
+U32 IBWTWalker::read(U8* buf, U32 n) {
+  if (total==U32(-1) || n>total-done) n=total-done;
+  const U32 end=done+n;
+  while (started<parts && pos[order[started]]<end)
+    d[order[started]]=start(order[started]), ++started;
+  U32 na=0;
+  for (U32 i=finished; i<started; ++i) act[na++]=order[i];
+  while (na>0) {
+    for (U32 i=0; i<na;) {
+      const U32 w=act[i], x=d[w]=next(d[w]);
+      buf[pos[w]-done]=byte(x);
+      if (++pos[w]==stop[w] || pos[w]==end) act[i]=act[--na];
+      else ++i;
+    }
+  }
+  while (finished<started && pos[order[finished]]==stop[order[finished]])
+    ++finished;
+  done=end;
+  return n;
+}
+
+// Shift byte x at offset c of the IBWT output into R4:R5 and inverse
+// E8E9 transform it as in the BWT PCOMP for large blocks
+static inline void shiftE8e9(U32& r4, U32& r5, U32 x, U32 c) {
+  r5=r4;
+  r4=r4>>8|x<<24;
+  if (c>3 && (r5&254)==232 && (((r4>>24)+1)&254)<2)
+    r4=(r4>>24<<24)|((r4-c+4)&0xffffff);
+}
+
+// "pcomp bwtrle": save the BWT in M, then at EOS invert it using counts
+// in H[~0..~255] and a linked list in H. If nativeArg then M[i] is
+// packed into the low 8 bits of H[i] before traversing the list.
+void ZPAQL::runBwtrle(U32 input) {
+  if (input<=255) {
+    m(b)=input;
+    ++b;
+    return;
+  }
+  U32* const hp=&h[0];
+  U8* const mp=&m[0];
+  const size_t hmask=h.size()-1, mmask=m.size()-1;
+
+  // index in last 4 bytes, size
+  c=0;
+  for (int i=0; i<4; ++i) c=c<<8|mp[--b&mmask];
+  r[1]=c;
+  r[2]=b;
+
+  // count bytes, then cumulative counts
+  for (; b>0; --b) ++hp[~U32((mp[(b-1)&mmask]+1)&255)&hmask];
+  hp[hmask]=1;
+  U32 t=0;
+  for (U32 i=0; i<256; ++i) t=hp[~i&hmask]+=t;
+
+  // build list skipping the index
+  for (b=0; c>b; ++b) hp[(++hp[~U32(mp[b&mmask])&hmask]-1)&hmask]=b;
+  for (b=c+1, c=r[2]; c>b; ++b)
+    hp[(++hp[~U32(mp[b&mmask])&hmask]-1)&hmask]=b;
+  if (nativeArg)
+    for (b=0; c>b; ++b) hp[b&hmask]=(hp[b&hmask]<<8)+mp[b&mmask];
+
+  // traverse large lists with IBWTWalker, reading its output into buf
+  const U32 n=c;
+  IBWTWalker walker(hp, hmask, nativeArg ? 0 : mp, mmask, r[1], n);
+  const bool walk=walker.size()!=U32(-1);
+  Array<U8> buf(walk ? IBWTWalker::WINDOW : 0);
+  U32 k=0;
+
+  if (nativeArg) {  // list in H[i]>>8, M[i] in H[i]&255
+    d=r[1];
+    b=0;
+    if (walk) {
+      while ((k=walker.read(&buf[0], buf.size()))>0) {
+        if (!nativeE8) outs(&buf[0], k);
+        else for (U32 i=0; i<k; ++i) mp[b++&mmask]=buf[i];
+      }
+      d=0;
+    }
+    while (d!=0) {
+      d=hp[d&hmask]>>8;
+      if (nativeE8) mp[b++&mmask]=hp[d&hmask];
+      else outc(hp[d&hmask]&255);
+    }
+    if (nativeE8) {
+      d=b;
+      c=unE8e9(d, c);
+      b=d;
+    }
+  }
+  else if (nativeE8) {  // traverse with inverse E8E9 in R4:R5
+    --r[2];
+    c=0;
+    d=r[1];
+    if (walk) {
+      while ((k=walker.read(&buf[0], buf.size()))>0) {
+        for (U32 i=0; i<k; ++i, ++c) {
+          shiftE8e9(r[4], r[5], buf[i], c);
+          if (c>3) outc(r[5]&255);
+        }
+      }
+      d=0;
+    }
+    while (d!=0) {
+      d=hp[d&hmask];
+      shiftE8e9(r[4], r[5], mp[d&mmask], c);
+      if (c>3) outc(r[5]&255);
+      ++c;
+    }
+    b=r[4];
+    for (U32 i=4; i>0; --i) {  // output up to 4 pending bytes
+      if (c>i-1) outc(b&255);
+      if (i>1) b>>=8;
+    }
+  }
+  else {  // traverse and output
+    d=r[1];
+    if (walk) {
+      while ((k=walker.read(&buf[0], buf.size()))>0) outs(&buf[0], k);
+      if (walker.size()>0) b=0;
+      d=0;
+    }
+    while (d!=0) {
+      d=hp[d&hmask];
+      b=d;
+      outc(mp[b&mmask]);
+    }
+  }
+}
+
+// "pcomp e8e9": delay output by 4 bytes in B and inverse E8E9 transform.
+// C counts input bytes up to 4.
+void ZPAQL::runE8e9(U32 input) {
+  if (input>255) {  // EOS: output pending bytes
+    if (c>4) c=4;
+    else d=(4-c)*8, b>>=d&31;
+    for (; c>0; --c) outc(b&255), b>>=8;
+    return;
+  }
+  m(b)=b;
+  d=input<<24;
+  b=(b>>8)+d;
+  ++c;
+  if (c>4) {
+    const U32 x=m(b);
+    outc(x);
+    if ((x&254)==232 && (((b>>24)+1)&254)==0) {
+      d=b>>24<<24;
+      b=d|((b-c+5)&0xffffff);
+    }
+  }
+}
+
 // Compress from in to out in 1 segment in 1 block using the algorithm
 // descried in method. If method begins with a digit then choose
 // a method depending on type. Save filename and comment
 // in the segment header. If comment is 0 then the default is the input size
 // as a decimal string, plus " jDC\x01" for a journaling method (method[0]
 // is not 's'). Write the generated method to methodOut if not 0.
-void compressBlock(StringBuffer* in, Writer* out, const char* method_,
-                   const char* filename, const char* comment, bool dosha1) {
+// Expand a numeric method "LB,R,t" to a method "xB,..." for in
+// as described for compress(). Return other methods unchanged.
+static std::string expandMethod(StringBuffer* in, const char* method_) {
   assert(in);
-  assert(out);
   assert(method_);
   assert(method_[0]);
   std::string method=method_;
@@ -7564,18 +9851,6 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
     else type=arg[1]*4+arg[2];
   }
 
-  // Get hash of input
-  libzpaq::SHA1 sha1;
-  const char* sha1ptr=0;
-#ifdef DEBUG
-  if (true) {
-#else
-  if (dosha1) {
-#endif
-    sha1.write(in->c_str(), n);
-    sha1ptr=sha1.result();
-  }
-
   // Expand default methods
   if (isdigit(method[0])) {
     const int level=method[0]-'0';
@@ -7609,8 +9884,8 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
       if (type<32) method+=",0";
       else {
         method+=","+itos(1+doe8)+",";
-        if (type<64) method+="4,0,3"+htsz;
-        else method+="4,0,7"+sasz+",1";
+        if (type<64) method+="4,0,3"+htsz+",0,1";
+        else method+="4,0,7"+sasz+",1,1";
       }
     }
 
@@ -7689,13 +9964,43 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
       method+="c0,2,0,255i1c0,3,0,0,255i1c0,4,0,0,0,255i1mm16ts19t0";
     }
   }
+  return method;
+}
+
+void compressBlock(StringBuffer* in, Writer* out, const char* method_,
+                   const char* filename, const char* comment, bool dosha1,
+                   int threads, double maxmem, Compressor* cp) {
+  assert(in);
+  assert(out);
+  assert(method_);
+  assert(method_[0]);
+  const unsigned n=in->size();  // input size
+
+  // Get hash of input
+  libzpaq::SHA1 sha1;
+  const char* sha1ptr=0;
+#ifdef DEBUG
+  if (true) {
+#else
+  if (dosha1) {
+#endif
+    sha1.write(in->c_str(), n);
+    sha1ptr=sha1.result();
+  }
+
+  // Expand default methods
+  const std::string method=expandMethod(in, method_);
+  const bool lowmem=maxmem>0
+      && compressBlockMemory(in, method.c_str())>maxmem;
 
   // Compress
   std::string config;
   int args[9]={0};
   config=makeConfig(method.c_str(), args);
   assert(n<=(0x100000u<<args[0])-4096);
-  libzpaq::Compressor co;
+  Compressor tmp;
+  Compressor& co=cp ? *cp : tmp;
+  co.reset();
   co.setOutput(out);
 #ifdef DEBUG
   co.setVerify(true);
@@ -7707,7 +10012,7 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
   if (comment) cs=cs+" "+comment;
   co.startSegment(filename, cs.c_str());
   if (args[1]>=1 && args[1]<=7 && args[1]!=4) {  // LZ77 or BWT
-    LZBuffer lz(*in, args);
+    LZBuffer lz(*in, args, 0, threads, lowmem);
     co.setInput(&lz);
     co.compress();
   }
@@ -7730,4 +10035,34 @@ void compressBlock(StringBuffer* in, Writer* out, const char* method_,
   co.endBlock();
 }
 
+// Return the approximate memory in bytes needed by compressBlock()
+// to compress in with method, not counting in or the output.
+// If the total would exceed maxmem > 0 then count the low memory index.
+double compressBlockMemory(StringBuffer* in, const char* method,
+                           double maxmem) {
+  const std::string m=expandMethod(in, method);
+  int args[9]={0};
+  const std::string config=makeConfig(m.c_str(), args);
+  ZPAQL hz, pz;
+  Compiler(config.c_str(), args, hz, pz, 0);
+  double mem=hz.memory();
+  if (args[1]>=1 && args[1]<=7 && args[1]!=4) {  // LZBuffer ht
+    const double n=in->size(), w=pow2(args[0]+17);
+    double lz, low;
+    if ((args[1]&3)==3)  // BWT
+      lz=4*(n+1), low=n+1+lowMemoryBWTMemory(n);
+    else if (args[5]-args[0]<21)  // LZ77 hash
+      lz=low=4*pow2(args[5]);
+    else  // LZ77 SA and ISA
+      lz=4*(n+w), low=4*(std::min(n, 2*w)+w);
+    if (args[7]>0 && (args[1]&3)<3) {  // optimal parse nodes, hash chains
+      double parse=1<<21;
+      if (args[5]-args[0]<21) parse+=4*std::min(pow2(args[5]), pow2(lg(n)));
+      lz+=parse, low+=parse;
+    }
+    mem+=maxmem>0 && mem+lz>maxmem ? low : lz;
+  }
+  return mem;
+}
+
 }  // end namespace libzpaq
@@ -16,7 +16,8 @@ and link to libzpaq.cpp (and advapi32.lib in Windows/VC++).
 libzpaq recognizes the following options:
 
   -DDEBUG   Turn on assertion checks (slower).
-  -DNOJIT   Don't assume x86-32 or x86-64 with SSE2 (slower).
+  -DNOJIT   Don't assume x86-32 or x86-64 with SSE2 (slower). Also turns
+            off SHA-1 with SHA or AVX2 instructions selected at run time.
   -Dunix    Without -DNOJIT, assume Unix (Linux, Mac) rather than Windows.
 
 The application must provide an error handling function and derived
@@ -125,6 +126,7 @@ context model, if any, of the transformed data. The arguments to "x" are:
   N5: LZ77 log search depth.
   N6: LZ77 log hash table size, or N1+21 to use a suffix array.
   N7: LZ77 lookahead.
+  N8: LZ77 1 = optimal parse.
 
 N2 selects the basic transform applied before context modeling.
 N2 = 0 does not transform the input. N2 = 1 selects LZ77 encoding
@@ -173,6 +175,14 @@ bytes not to match and be coded as literals if this results in
 a significantly longer match. Values higher than 1 are rarely effective.
 The default is 0.
 
+N8 = 1 selects optimal parsing. Instead of coding the best match at
+each position, it finds the sequence of literals and matches with the
+smallest total code length within blocks of 2 KiB. A hash table is
+searched by hash chains of up to 2^N5 earlier positions, and N4 and N7
+have no effect. It is several times slower to compress and adds about
+2 MB of memory plus 4 x 2^N6 bytes for a hash table. Decompression
+speed is unchanged. The default is 0, which codes matches greedily.
+
 All subsequent commands after "x" describe a context model. A model
 consists of a set of components that output a bit prediction, taking
 a context and possibly earlier predictions as input. The final prediction
@@ -291,12 +301,46 @@ a single block, regardless of the N1 (block size) argument in the method.
 
   void compressBlock(StringBuffer* in, Writer* out, const char* method,
                      const char* filename=0, const char* comment=0,
-                     bool compute_sha1=false);
+                     bool compute_sha1=false, int threads=1,
+                     double maxmem=0, Compressor* co=0);
+
+threads is the maximum number of threads used to sort suffixes for
+BWT and suffix array LZ77 methods with blocks of at least 1 MiB.
+The output does not depend on it.
+
+If maxmem > 0 and compressBlockMemory(in, method) exceeds it, then
+BWT and suffix array LZ77 use a smaller index. BWT output is the
+same but slower to compute. LZ77 searches only the previous
+2^(B+17) bytes, which may compress worse.
+
+If co is 0 (default), then compressBlock() uses a temporary Compressor
+and frees all of its memory before returning. Otherwise it resets and
+uses *co, which keeps the context model memory and JIT code of the
+block until the next call or until *co is destroyed. A following block
+with a model of the same shape reuses them instead of allocating and
+compiling again.
+
+  void setHugePages(int mode);
+
+makes later allocations of model tables and other arrays of at least
+2 MiB use huge pages to reduce TLB misses: 0 = no (default), 1 =
+transparent huge pages (madvise(MADV_HUGEPAGE) in Linux), 2 = reserved
+hugetlb pages in Linux or large pages in Windows, using 1 if none are
+available. Arrays are allocated normally where a mode is not supported.
+Call it before compressing or decompressing, not while other threads are.
 
 A StringBuffer is both a Reader and a Writer, but also allows random
 memory access. It provides convenient and efficient storage when the
 input size is unknown.
 
+  double compressBlockMemory(StringBuffer* in, const char* method,
+                             double maxmem=0);
+
+returns the approximate number of bytes that compressBlock() would
+allocate to compress in with method, including the context model and
+any LZ77 or BWT index, but not in itself or the output. If maxmem > 0
+then it counts the index that compressBlock() would use with maxmem.
+
   class StringBuffer: public libzpaq::Reader, public libzpaq::Writer {
   public:
     StringBuffer(size_t n=0);     // initial allocation after first use
@@ -404,6 +448,11 @@ or a 1 followed by the 20 byte saved hash. If any data is skipped,
 then all data in the remaining segments in the current block must
 also be skipped.
 
+reset() discards any buffered input and prepares to find a new block,
+so that one Decompresser can read blocks from many sources. A block
+with the same header as the previous one reuses its JIT code and
+memory rather than compiling and allocating them again.
+
 
 SHA1
 
@@ -420,7 +469,16 @@ size() returns the number of bytes read as a double, and usize() as a
 64 bit integer. result() returns a pointer to the 20 byte hash and
 resets the size to 0. The hash (not just the pointer) should be copied
 before the next call to result() if you want to save it. You can also
-call sha1.write(buffer, n) to hash n bytes of char* buffer.
+call sha1.write(buffer, n) to hash n bytes of char* buffer. If the
+processor supports x86 SHA instructions then they are used automatically.
+To hash many independent buffers at once, such as the fragments of a
+block, call:
+
+  libzpaq::sha1Multi(n, buf, len, result);
+
+to store the hash of buf[i][0..len[i]-1] in result[20*i..20*i+19] for
+i = 0..n-1. If the processor supports AVX2 but not SHA instructions,
+then groups of 4 to 8 buffers of similar length are hashed in parallel.
 
 
 COMPRESSOR
@@ -498,7 +556,8 @@ The first argument is a description of the compression algorithm in
 the ZPAQL language. It is compiled into byte code and saved in the
 archive block header so that the decompressor knows how read the data.
 A ZPAQL program accepts up to 9 numeric arguments, which should be
-passed in array.
+passed in array. A Compressor keeps the last compiled program with its
+arguments, so later blocks that use the same ones are not compiled again.
 
 A decompression algorithm has two optional parts, a context mixing
 model and a postprocessor. The context model is identical for both
@@ -530,6 +589,10 @@ to size. If the second argument is false then the computed checksum is
 not saved to output. Default is true. If setVerify is false, then no
 checksum is saved and the function returns 0 with size not written.
 
+After endBlock(), a Compressor can start another block. Component
+arrays of the same size as in the last block are reused. reset()
+discards an unfinished block, for example after an error.
+
 A context model consists of two parts, an array COMP of n components,
 and some code HCOMP that computes contexts for the components.
 The model compresses one bit at a time (MSB to LSB order) by computing
@@ -719,7 +782,13 @@ string contains newlines, it will report the line number of the error.
 
 ZPAQL is compiled internally into a byte code, and then to native x86
 32 or 64 bit code (unless compiled with -DNOJIT, in which case the
-byte code is interpreted). You can also specify the algorithm directly
+byte code is interpreted, with g++ or clang as direct threaded code
+that fuses common instruction pairs). The PCOMP sections that
+compressBlock() generates for LZ77, BWT, and E8E9 preprocessing are
+recognized when loaded and run as equivalent C++ code instead,
+producing the same output. With -DNOJIT, the COMP models it generates
+for levels 3-5 are predicted by C++ code specialized on their component
+types rather than interpreted. You can also specify the algorithm directly
 in byte code, although this is less convenient because it requires two
 steps:
 
@@ -809,6 +878,11 @@ with i = 0. For example:
   a.encrypt(buf, 400, 100);  // encrypt next 400 bytes
   a.encrypt(buf, 500, 0);    // decrypt in one step
 
+encrypt(buf, n, offset) uses AES-NI, or VAES for n >= 512, if
+the processor supports them (detected at run time, except with NOJIT).
+It does not modify the AES_CTR object, so different slices
+may be encrypted by different threads at the same time.
+
 libzpaq::stretchKey(char* out, const char* in, const char* salt);
 
 Generate a 32 byte key out[0..31] from key[0..31] and salt[0..31]
@@ -878,6 +952,15 @@ public:
 // Read 16 bit little-endian number
 int toU16(const char* p);
 
+// Allocate and free n bytes of zeroed memory for an Array
+enum {HUGEPAGE=1<<21};  // huge page size, smallest Array to use them
+void* allocArray(size_t n, int& offset);
+void freeArray(void* p, size_t n, int offset);
+
+// Back Arrays of at least HUGEPAGE bytes with huge pages: 0=no (default),
+// 1=transparent huge pages, 2=reserved hugetlb pages, else 1.
+void setHugePages(int mode);
+
 // An Array of T is cleared and aligned on a 64 byte address
 //   with no constructors called. No copy or assignment.
 // Array<T> a(n, ex=0);  - creates n<<ex elements of type T
@@ -888,7 +971,7 @@ template <typename T>
 class Array {
   T *data;     // user location of [0] on a 64 byte boundary
   size_t n;    // user size
-  int offset;  // distance back in bytes to start of actual allocation
+  int offset;  // distance back to start of allocation, 0 for huge pages
   void operator=(const Array&);  // no assignment
   Array(const Array&);  // no copy
 public:
@@ -911,9 +994,8 @@ void Array<T>::resize(size_t sz, int ex) {
     sz*=2, --ex;
   }
   if (n>0) {
-    assert(offset>0 && offset<=64);
-    assert((char*)data-offset);
-    ::free((char*)data-offset);
+    assert(offset>=0 && offset<=64);
+    freeArray(data, n*sizeof(T), offset);
   }
   n=0;
   offset=0;
@@ -921,11 +1003,8 @@ void Array<T>::resize(size_t sz, int ex) {
   n=sz;
   const size_t nb=128+n*sizeof(T);  // test for overflow
   if (nb<=128 || (nb-128)/sizeof(T)!=n) n=0, error("Array too big");
-  data=(T*)::calloc(nb, 1);
+  data=(T*)allocArray(n*sizeof(T), offset);
   if (!data) n=0, error("Out of memory");
-  offset=64-(((char*)data-(char*)0)&63);
-  assert(offset>0 && offset<=64);
-  data=(T*)((char*)data+offset);
 }
 
 //////////////////////////// SHA1 ////////////////////////////
@@ -953,6 +1032,10 @@ private:
   void process();   // hash 1 block
 };
 
+// Hash buf[i][0..len[i]-1] to result[20*i..20*i+19] for i=0..n-1
+void sha1Multi(int n, const char* const* buf, const int64_t* len,
+               char* result);
+
 //////////////////////////// SHA256 //////////////////////////
 
 // For computing SHA-256 checksums
@@ -1061,12 +1144,31 @@ private:
   int pc;             // program counter
   int rcode_size;     // length of rcode
   U8* rcode;          // JIT code for run()
+  struct Op {         // threaded code for run0():
+    const void* code; //   handler address
+    U32 n;            //   operand or jump target index
+  };
+  Array<Op> ops;      // HCOMP/PCOMP decoded for run0()
+  int native;         // standard PCOMP run in C++ (NATIVE_*), or 0
+  int nativeArg;      // its rb, minimum match length, or fast IBWT flag
+  bool nativeE8;      // it ends with an E8E9 transform
 
   // Support code
   int assemble();  // put JIT code in rcode
   void init(int hbits, int mbits);  // initialize H and M sizes
   int execute();  // interpret 1 instruction, return 0 after HALT, else 1
   void run0(U32 input);  // default run() if not JIT
+  void decode(const void* const* jump);  // HCOMP/PCOMP to ops for run0()
+  bool runThreaded();  // run ops, return false if not decodable
+  void findNative();  // set native if PCOMP is a standard one
+  void runNative(U32 input);  // run() for a native PCOMP
+  void runLazy2(U32 input);  // native PCOMPs
+  void runLzpre(U32 input);
+  void runBwtrle(U32 input);
+  void runE8e9(U32 input);
+  U32 unE8e9(U32 n, U32 c);  // inverse E8E9 M[0..n-1] and output it
+  void outs(const U8* p, size_t n);  // output p[0..n-1]
+  void copyMatch(U64 n, bool out);  // copy n bytes from M[C] to M[B]
   void div(U32 x) {if (x) a/=x; else a=0;}
   void mod(U32 x) {if (x) a%=x; else a=0;}
   void swap(U32& x) {a^=x; x^=a; a^=x;}
@@ -1139,6 +1241,8 @@ private:
   // Modeling support functions
   int predict0();       // default
   void update0(int y);  // default
+  int (Predictor::*predictk)();      // specialized predict0() or 0
+  void (Predictor::*updatek)(int y); // specialized update0() or 0
   int dt2k[256];        // division table for match: dt2k[i] = 2^12/i
   int dt[1024];         // division table for cm: dt[i] = 2^16/(i+1.5)
   U16 squasht[4096];    // squash() lookup table
@@ -1146,6 +1250,7 @@ private:
   StateTable st;        // next, cminit functions
   U8* pcode;            // JIT code for predict() and update()
   int pcode_size;       // length of pcode
+  Array<U8> model;      // n (comp)[n] END that pcode was made for
 
   // reduce prediction error in cr.cm
   void train(Component& cr, int y) {
@@ -1187,6 +1292,17 @@ private:
   // Get cxt in ht, creating a new row if needed
   size_t find(Array<U8>& ht, int sizebits, U32 cxt);
 
+  // Component code and specialized predictors for component lists L
+  template <int T> void predictComp(int i, const U8* cp);
+  template <int T> void updateComp(int i, const U8* cp, int y);
+  void updateContext(int y);
+  template <class L> void predictList(int i, const U8* cp);
+  template <class L> void updateList(int i, const U8* cp, int y);
+  template <class L> int predictK();
+  template <class L> void updateK(int y);
+  template <class L> bool useKernel();
+  void findKernel();
+
   // Put JIT code in pcode
   int assemble_p();
 };
@@ -1211,6 +1327,7 @@ public:
     return rpos<wpos ? U8(buf[rpos++]) : -1;
   }
   int buffered() {return wpos-rpos;}  // how far read ahead?
+  void discard() {rpos=wpos=0;}       // drop buffered input
 private:
   U32 low, high;     // range
   U32 curr;          // last 4 bytes of archive or remaining bytes in subblock
@@ -1255,6 +1372,7 @@ public:
   void readSegmentEnd(char* sha1string = 0);
   int stat(int x) {return dec.stat(x);}
   int buffered() {return dec.buffered();}
+  void reset() {state=BLOCK; decode_state=FIRSTSEG; dec.discard();}
 private:
   ZPAQL z;
   Decoder dec;
@@ -1359,6 +1477,7 @@ public:
   int64_t getSize() {return sha1.usize();}
   const char* getChecksum() {return sha1.result();}
   void endBlock();
+  void reset() {state=INIT; sha1.result();}  // discard unfinished block
   int stat(int x) {return enc.stat(x);}
 private:
   ZPAQL z, pz;  // model and test postprocessor
@@ -1368,6 +1487,8 @@ private:
   char sha1result[20];  // sha1 output
   enum {INIT, BLOCK1, SEG1, BLOCK2, SEG2} state;
   bool verify;  // if true then test by postprocessing
+  Array<char> last;  // config, NUL, and args[9] of last startBlock()
+  Array<char> lastHcomp, lastPcomp, lastCmd;  // its compiled z, pz, command
 };
 
 /////////////////////////// StringBuffer /////////////////////
@@ -1502,8 +1623,17 @@ void compress(Reader* in, Writer* out, const char* method,
      const char* filename=0, const char* comment=0, bool dosha1=true);
 
 // Same as compress() but output is 1 block, ignoring block size parameter.
+// Use up to threads threads to build a suffix array for large blocks.
+// If maxmem > 0 then use a smaller suffix array index if needed to fit.
+// If co is not 0 then use it and keep its model for the next call.
 void compressBlock(StringBuffer* in, Writer* out, const char* method,
-     const char* filename=0, const char* comment=0, bool dosha1=true);
+     const char* filename=0, const char* comment=0, bool dosha1=true,
+     int threads=1, double maxmem=0, Compressor* co=0);
+
+// Return approximate memory used by compressBlock(in, out, method)
+// not counting in and out.
+double compressBlockMemory(StringBuffer* in, const char* method,
+     double maxmem=0);
 
 }  // namespace libzpaq
 
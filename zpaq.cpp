@@ -115,6 +115,7 @@ Possible options:
 using std::string;
 using std::vector;
 using std::map;
+using std::pair;
 using std::min;
 using std::max;
 using libzpaq::StringBuffer;
@@ -228,8 +229,160 @@ private:
 
 #endif
 
+// An Executor runs tasks on a fixed pool of threads. Use like this:
+//
+// void task(void* arg, int worker) {...}  // worker = 0..size()-1
+// Executor ex(threads);
+// ex.submit(task, arg, priority);  // run task(arg, worker) eventually
+// ex.wait();                       // until all submitted tasks finish
+//
+// Each worker has its own queue, ordered by priority, highest first.
+// Tasks submitted by a task to its own worker go to that queue, others
+// are spread round robin. An idle worker takes its own highest priority
+// task or else steals the highest priority task of another worker.
+// Priority is normally the task size so that large tasks start first.
+// Tasks may submit more tasks. An exception thrown by a task is fatal.
+class Executor {
+public:
+  typedef void (*Task)(void* arg, int worker);
+  Executor(int threads);
+  ~Executor();
+  void submit(Task f, void* arg, double priority=0, int worker=-1);
+  void wait();
+  int size() const {return int(tid.size());}
+private:
+  struct Item {
+    Task f;
+    void* arg;
+    double priority;
+    bool operator<(const Item& x) const {return priority<x.priority;}
+  };
+  struct Queue {
+    Mutex mutex;       // protects heap
+    vector<Item> heap; // max-heap by priority
+  };
+  vector<ThreadID> tid;  // workers
+  Queue* q;          // one per worker
+  Mutex mutex;       // protects started, pending, next, waiters
+  int started;       // number of workers started
+  int pending;       // tasks submitted but not finished
+  unsigned next;     // queue for next task not from a worker
+  int waiters;       // threads in wait()
+  volatile bool stopping;  // true if workers should exit
+  Semaphore work;    // number of queued tasks, plus workers at exit
+  Semaphore done;    // signaled to waiters when pending reaches 0
+  bool take(int w, Item& it);  // remove next task for worker w
+  friend ThreadReturn executorThread(void* arg);
+};
+
+// Run tasks until the Executor is destroyed
+ThreadReturn executorThread(void* arg) {
+  Executor& ex=*(Executor*)arg;
+  lock(ex.mutex);
+  const int w=ex.started++;
+  release(ex.mutex);
+  try {
+    Executor::Item it;
+    while (true) {
+      ex.work.wait();
+      if (!ex.take(w, it)) break;
+      it.f(it.arg, w);
+      lock(ex.mutex);
+      if (--ex.pending==0)
+        for (; ex.waiters>0; --ex.waiters) ex.done.signal();
+      release(ex.mutex);
+    }
+  }
+  catch (std::exception& e) {
+    fflush(stdout);
+    fprintf(stderr, "zpaq exiting from job %d: %s\n", w+1, e.what());
+    exit(1);
+  }
+  return 0;
+}
+
+Executor::Executor(int threads):
+    tid(threads>0 ? threads : 1), q(0), started(0), pending(0), next(0),
+    waiters(0), stopping(false) {
+  q=new Queue[tid.size()];
+  if (!q) throw std::bad_alloc();
+  for (unsigned i=0; i<tid.size(); ++i) init_mutex(q[i].mutex);
+  init_mutex(mutex);
+  work.init(0);
+  done.init(0);
+  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], executorThread, this);
+}
+
+// Finish all tasks and stop the workers
+Executor::~Executor() {
+  wait();
+  stopping=true;
+  for (unsigned i=0; i<tid.size(); ++i) work.signal();
+  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  done.destroy();
+  work.destroy();
+  destroy_mutex(mutex);
+  for (unsigned i=0; i<tid.size(); ++i) destroy_mutex(q[i].mutex);
+  delete[] q;
+}
+
+// Queue f(arg, worker) to run. If worker is the caller's own worker
+// number then queue it there.
+void Executor::submit(Task f, void* arg, double priority, int worker) {
+  lock(mutex);
+  ++pending;
+  if (worker<0 || worker>=size()) worker=next++%tid.size();
+  release(mutex);
+  Item it;
+  it.f=f;
+  it.arg=arg;
+  it.priority=priority;
+  Queue& qw=q[worker];
+  lock(qw.mutex);
+  qw.heap.push_back(it);
+  std::push_heap(qw.heap.begin(), qw.heap.end());
+  release(qw.mutex);
+  work.signal();
+}
+
+// Wait until all submitted tasks have finished
+void Executor::wait() {
+  lock(mutex);
+  if (pending==0) {
+    release(mutex);
+    return;
+  }
+  ++waiters;
+  release(mutex);
+  done.wait();
+}
+
+// Remove the highest priority task from queue w, or steal the highest
+// priority task of the first other queue that has one. After
+// work.wait() there is a task for every waiting worker, but another
+// worker might take the one seen, so search again until one is found.
+// Return false if the Executor is being destroyed.
+bool Executor::take(int w, Item& it) {
+  while (!stopping) {
+    for (unsigned i=0; i<tid.size(); ++i) {
+      Queue& qi=q[(w+i)%tid.size()];
+      lock(qi.mutex);
+      if (qi.heap.size()>0) {
+        std::pop_heap(qi.heap.begin(), qi.heap.end());
+        it=qi.heap.back();
+        qi.heap.pop_back();
+        release(qi.mutex);
+        return true;
+      }
+      release(qi.mutex);
+    }
+  }
+  return false;
+}
+
 // Global variables
 int64_t global_start=0;  // set to mtime() at start of main()
+Executor* crypt_executor=0;  // helps encrypt large buffers if not 0
 
 // In Windows, convert 16-bit wide string to UTF-8 and \ to /
 #ifndef unix
@@ -301,6 +454,20 @@ int64_t mtime() {
 #endif
 }
 
+// Return CPU time used by the calling thread in milliseconds
+double threadTime() {
+#ifdef unix
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec*1000.0+ts.tv_nsec/1000000.0;
+#else
+  FILETIME create, exit, kernel, user;
+  GetThreadTimes(GetCurrentThread(), &create, &exit, &kernel, &user);
+  return ((int64_t(kernel.dwHighDateTime)+user.dwHighDateTime)*4294967296.0
+      +kernel.dwLowDateTime+user.dwLowDateTime)/10000.0;
+#endif
+}
+
 // Convert 64 bit decimal YYYYMMDDHHMMSS to "YYYY-MM-DD HH:MM:SS"
 // where -1 = unknown date, 0 = deleted.
 string dateToString(int64_t date) {
@@ -613,15 +780,121 @@ string subpart(string fn, int part) {
   return fn;
 }
 
+// A buffer to be encrypted in slices by the caller of cryptBuffer() and
+// by helper tasks on crypt_executor. Each claims the next slice until
+// none are left. The caller then waits for slices claimed by helpers,
+// so it never waits for a helper that has not started. The last of the
+// caller and helpers to finish deletes it.
+struct CryptJob {
+  Mutex mutex;       // protects next, running, waiting, refs
+  Semaphore done;    // signaled when running reaches 0 if waiting
+  libzpaq::AES_CTR* aes;
+  char* buf;         // buf[0..n-1] at archive offset off
+  int n, step, k;    // k slices of step bytes, the last n-(k-1)*step
+  int64_t off;
+  int next;          // next slice to claim
+  int running;       // slices claimed by helpers, not done
+  bool waiting;      // caller waits on done
+  int refs;          // caller plus helpers not finished
+  CryptJob(libzpaq::AES_CTR* a, char* b, int n_, int64_t o, int k_):
+      aes(a), buf(b), n(n_), step(n_/k_&-16), k(k_), off(o), next(0),
+      running(0), waiting(false), refs(k_) {
+    init_mutex(mutex);
+    done.init(0);
+  }
+  ~CryptJob() {done.destroy(); destroy_mutex(mutex);}
+  void work(bool helper);  // encrypt slices until none are left
+};
+
+void CryptJob::work(bool helper) {
+  lock(mutex);
+  while (next<k) {
+    const int i=next++;
+    if (helper) ++running;
+    release(mutex);
+    aes->encrypt(buf+i*step, i<k-1 ? step : n-i*step, off+i*step);
+    lock(mutex);
+    if (helper && --running==0 && waiting) done.signal(), waiting=false;
+  }
+  if (!helper && running>0) {
+    waiting=true;
+    release(mutex);
+    done.wait();
+    lock(mutex);
+  }
+  const bool last=--refs==0;
+  release(mutex);
+  if (last) delete this;
+}
+
+void cryptTask(void* arg, int) {
+  ((CryptJob*)arg)->work(true);
+}
+
+// Encrypt or decrypt buf[0..n-1] at archive offset off. Buffers of at
+// least 2 MB are split into slices of at least 1 MB, one for each
+// worker of crypt_executor, since the CTR keystream of each slice
+// depends only on its offset. Idle workers help and busy ones are not
+// waited for, so at most the Executor's threads ever encrypt at once.
+void cryptBuffer(libzpaq::AES_CTR* aes, char* buf, int n, int64_t off) {
+  const int MINSLICE=1<<20;
+  const int k=crypt_executor ? min(crypt_executor->size(), n/MINSLICE) : 0;
+  if (k<2) {
+    aes->encrypt(buf, n, off);
+    return;
+  }
+  CryptJob* job=new CryptJob(aes, buf, n, off, k);
+  for (int i=1; i<k; ++i)  // ahead of larger tasks, someone is waiting
+    crypt_executor->submit(cryptTask, job, 1e300);
+  job->work(false);
+}
+
+// Keyed AES_CTR contexts by salt and password. The key is stretched
+// by scrypt (16 MB, about 0.1 second) once per process rather than
+// once for each InputArchive or OutputArchive, such as one for each
+// extract thread. Contexts are shared, not copied, and never modified
+// after construction, so they are safe to use from any thread.
+class KeyCache {
+  Mutex mutex;  // protects aes
+  map<string, libzpaq::AES_CTR*> aes;  // by salt[0..31]+password[0..31]
+public:
+  KeyCache() {init_mutex(mutex);}
+  ~KeyCache();
+  libzpaq::AES_CTR* get(const char* password, const char* salt);
+} keyCache;
+
+KeyCache::~KeyCache() {
+  for (map<string, libzpaq::AES_CTR*>::iterator p=aes.begin();
+       p!=aes.end(); ++p)
+    delete p->second;
+  destroy_mutex(mutex);
+}
+
+// Return the context for password[0..31] and salt[0..31]. The first caller
+// for a salt stretches the key while other callers wait.
+libzpaq::AES_CTR* KeyCache::get(const char* password, const char* salt) {
+  assert(password);
+  assert(salt);
+  const string k=string(salt, 32)+string(password, 32);
+  lock(mutex);
+  libzpaq::AES_CTR*& r=aes[k];
+  if (!r) {
+    char key[32];
+    libzpaq::stretchKey(key, password, salt);
+    r=new libzpaq::AES_CTR(key, 32, salt);
+  }
+  release(mutex);
+  return r;
+}
+
 // Base of InputArchive and OutputArchive
 class ArchiveBase {
 protected:
-  libzpaq::AES_CTR* aes;  // NULL if not encrypted
+  libzpaq::AES_CTR* aes;  // NULL if not encrypted, owned by keyCache
   FP fp;          // currently open file or FPNULL
 public:
   ArchiveBase(): aes(0), fp(FPNULL) {}
   ~ArchiveBase() {
-    if (aes) delete aes;
     if (fp!=FPNULL) fclose(fp);
   }  
   bool isopen() {return fp!=FPNULL;}
@@ -652,7 +925,7 @@ public:
       nr=fread(obuf, 1, len, fp);
     }
     if (nr==0) return 0;
-    if (aes) aes->encrypt(obuf, nr, off);
+    if (aes) cryptBuffer(aes, obuf, nr, off);
     off+=nr;
     return nr;
   }
@@ -727,10 +1000,9 @@ InputArchive::InputArchive(const char* filename, const char* password):
 
   // Get encryption salt
   if (password) {
-    char salt[32], key[32];
+    char salt[32];
     if (fread(salt, 1, 32, fp)!=32) error("cannot read salt");
-    libzpaq::stretchKey(key, password, salt);
-    aes=new libzpaq::AES_CTR(key, 32, salt);
+    aes=keyCache.get(password, salt);
     off=32;
   }
 }
@@ -739,8 +1011,9 @@ InputArchive::InputArchive(const char* filename, const char* password):
 class OutputArchive: public ArchiveBase, public libzpaq::Writer {
   int64_t off;    // preceding multi-part bytes
   unsigned ptr;   // write pointer in buf: 0 <= ptr <= BUFSIZE
-  enum {BUFSIZE=1<<16};
+  enum {BUFSIZE=1<<16, EBUFSIZE=1<<22};
   char buf[BUFSIZE];  // I/O buffer
+  string ebuf;    // encryption buffer for large writes
 public:
 
   // Open. If password then encrypt output.
@@ -751,7 +1024,7 @@ public:
   void flush() {
     assert(fp!=FPNULL);
     if (aes) aes->encrypt(buf, ptr, ftello(fp)+off);
-    fwrite(buf, 1, ptr, fp);
+    if (ptr>0 && fwrite(buf, 1, ptr, fp)!=ptr) error("archive write error");
     ptr=0;
   }
 
@@ -780,10 +1053,35 @@ public:
     }
   }
 
-  // Write buf[0..n-1]
+  // Write buf[0..n-1]. Writes of at least BUFSIZE bytes go directly to
+  // the file if not encrypted, or are encrypted in EBUFSIZE chunks in
+  // ebuf by cryptBuffer().
   void write(const char* ibuf, int len) {
-    if (fp==FPNULL) off+=len;
-    else while (len-->0) put(*ibuf++);
+    if (fp==FPNULL) {
+      off+=len;
+      return;
+    }
+    if (len<=0) return;
+    if (ptr+len>BUFSIZE) flush();
+    if (len<BUFSIZE) {
+      memcpy(buf+ptr, ibuf, len);
+      ptr+=len;
+    }
+    else if (!aes) {
+      if (fwrite(ibuf, 1, len, fp)!=unsigned(len))
+        error("archive write error");
+    }
+    else {
+      while (len>0) {
+        const int n=len<EBUFSIZE ? len : EBUFSIZE;
+        ebuf.assign(ibuf, n);
+        cryptBuffer(aes, &ebuf[0], n, ftello(fp)+off);
+        if (fwrite(ebuf.data(), 1, n, fp)!=unsigned(n))
+          error("archive write error");
+        ibuf+=n;
+        len-=n;
+      }
+    }
   }
 
   // Flush output and close
@@ -832,11 +1130,7 @@ OutputArchive::OutputArchive(const char* filename, const char* password,
   }
 
   // Set up encryption
-  if (password) {
-    char key[32];
-    libzpaq::stretchKey(key, password, salt);
-    aes=new libzpaq::AES_CTR(key, 32, salt);
-  }
+  if (password) aes=keyCache.get(password, salt);
 }
 
 ///////////////////////// System info /////////////////////////////////
@@ -893,6 +1187,14 @@ struct StringWriter: public libzpaq::Writer {
   }
 };
 
+// For libzpaq output that only needs to be counted
+struct CountWriter: public libzpaq::Writer {
+  int64_t n;
+  CountWriter(): n(0) {}
+  void put(int) {++n;}
+  void write(const char*, int k) {n+=k;}
+};
+
 // In Windows convert upper case to lower case.
 inline int tolowerW(int c) {
 #ifndef unix
@@ -1015,9 +1317,10 @@ class CompressJob;
 class Jidac {
 public:
   int doCommand(int argc, const char** argv);
-  friend ThreadReturn decompressThread(void* arg);
+  friend void decompressTask(void* arg, int worker);
   friend ThreadReturn testThread(void* arg);
   friend struct ExtractJob;
+  friend void scanTask(void* arg, int w);
 private:
 
   // Command line arguments
@@ -1027,6 +1330,10 @@ private:
   int all;                  // -all option
   bool force;               // -force option
   int fragment;             // -fragment option
+  bool fastcdc;             // -chunker fastcdc option
+  bool group;               // -group option
+  int autotime;             // -auto option, ms per MB or 0 if off
+  int memory;               // -memory option in MiB or 0 if no limit
   const char* index;        // index option
   char password_string[32]; // hash of -key argument
   const char* password;     // points to password_string or NULL
@@ -1041,6 +1348,7 @@ private:
   int summary;              // summary option if > 0, detailed if -1
   bool dotest;              // -test option
   int threads;              // default is number of cores
+  Executor* executor;       // shared thread pool of size threads
   vector<string> tofiles;   // -to option
   int64_t date;             // now as decimal YYYYMMDDHHMMSS (UT)
   int64_t version;          // version number or 14 digit date
@@ -1106,6 +1414,14 @@ void Jidac::usage() {
 #ifndef NDEBUG
 "Advanced options:\n"
 "  -fragment N     Use 2^N KiB average fragment size (default: 6).\n"
+"  -chunker zpaq|fastcdc  Find fragment boundaries by order 1 prediction\n"
+"                  rolling hash (default) or by FastCDC gear hash.\n"
+"  -auto [N]       Select -method level L, L-1 or L-2 per block by trial\n"
+"                  compression within N CPU ms/MB (default: 1000).\n"
+"  -group          Group files with similar contents into blocks.\n"
+"  -hugepages [N]  Use huge pages for arrays of 2 MiB or more. N: 1=\n"
+"                  transparent (if omitted), 2=reserved hugetlb.\n"
+"  -memory N       Limit memory for compressing blocks to about N MiB.\n"
 "  -mNB -method NB Use 2^B MiB blocks (0..11, default: 04, 14, 26..56).\n"
 "  -method {xs}B[,N2]...[{ciawmst}[N1[,N2]...]]...  Advanced:\n"
 "  x=journaling (default). s=streaming (no dedupe).\n"
@@ -1168,6 +1484,10 @@ int Jidac::doCommand(int argc, const char** argv) {
   command=0;
   force=false;
   fragment=6;
+  fastcdc=false;
+  group=false;
+  autotime=0;
+  memory=0;
   all=0;
   password=0;  // no password
   index=0;
@@ -1178,6 +1498,7 @@ int Jidac::doCommand(int argc, const char** argv) {
   summary=0; // detailed: -1
   dotest=false;  // -test
   threads=0; // 0 = auto-detect
+  executor=0;
   version=DEFAULT_VERSION;
   date=0;
 
@@ -1216,8 +1537,24 @@ int Jidac::doCommand(int argc, const char** argv) {
       all=4;
       if (i<argc-1 && isdigit(argv[i+1][0])) all=atoi(argv[++i]);
     }
+    else if (opt=="-auto") {
+      autotime=1000;
+      if (i<argc-1 && isdigit(argv[i+1][0])) autotime=atoi(argv[++i]);
+    }
     else if (opt=="-force" || opt=="-f") force=true;
     else if (opt=="-fragment" && i<argc-1) fragment=atoi(argv[++i]);
+    else if (opt=="-chunker" && i<argc-1) {
+      const string chunker=argv[++i];
+      if (chunker=="fastcdc") fastcdc=true;
+      else if (chunker=="zpaq") fastcdc=false;
+      else usage();
+    }
+    else if (opt=="-group") group=true;
+    else if (opt=="-hugepages") {
+      int mode=1;
+      if (i<argc-1 && isdigit(argv[i+1][0])) mode=atoi(argv[++i]);
+      libzpaq::setHugePages(mode);
+    }
     else if (opt=="-index" && i<argc-1) index=argv[++i];
     else if (opt=="-key" && i<argc-1) {
       libzpaq::SHA256 sha256;
@@ -1225,6 +1562,7 @@ int Jidac::doCommand(int argc, const char** argv) {
       memcpy(password_string, sha256.result(), 32);
       password=password_string;
     }
+    else if (opt=="-memory" && i<argc-1) memory=atoi(argv[++i]);
     else if (opt=="-method" && i<argc-1) method=argv[++i];
     else if (opt[1]=='m') method=argv[i]+2;
     else if (opt=="-noattributes") noattributes=true;
@@ -1342,6 +1680,9 @@ int Jidac::doCommand(int argc, const char** argv) {
 #endif
 
   // Execute command
+  Executor ex(threads);
+  executor=&ex;
+  crypt_executor=&ex;
   if (command=='a' && files.size()>0) return add();
   else if (command=='x') return extract();
   else if (command=='l') list();
@@ -1696,6 +2037,134 @@ string path(const string& fn) {
   return fn.substr(0, n);
 }
 
+#ifdef unix
+
+// A ScanJob lists the contents of a directory tree in parallel.
+// Each directory is a scanTask on the Executor. It opens the directory
+// with openat() relative to its parent, lists it with fstatat(),
+// saves the selected entries in the list of the worker running it, and
+// submits the subdirectories not excluded by -not to the same worker,
+// where idle workers can steal them. The lists are merged into edt
+// after Executor::wait(). A directory stays open until its subdirectories
+// have opened themselves. Deeper directories have higher priority so
+// that only about one path per worker is open at a time.
+struct ScanJob {
+  Jidac& jd;                 // for isselected(), notfiles, noattributes
+  Executor& ex;              // runs scanTask
+  Mutex mutex;               // protects stderr and ScanOpen::refs
+  vector<vector<pair<string, DT> > > found;  // selected files by worker
+  ScanJob(Jidac& jd_, Executor& ex_):
+      jd(jd_), ex(ex_), found(ex_.size()) {
+    init_mutex(mutex);
+  }
+  ~ScanJob() {
+    destroy_mutex(mutex);
+  }
+};
+
+// An open directory, closed when its scanTask and all subdirectory
+// scanTasks are done with it
+struct ScanOpen {
+  DIR* dirp;
+  int refs;
+  ScanOpen(DIR* d): dirp(d), refs(1) {}
+};
+
+// Release one reference to p
+static void unref(ScanJob& job, ScanOpen* p) {
+  lock(job.mutex);
+  const bool last=--p->refs==0;
+  release(job.mutex);
+  if (last) {
+    closedir(p->dirp);
+    delete p;
+  }
+}
+
+// A directory to be listed by scanTask: path dir, opened as name
+// relative to parent, or by path if parent is 0.
+struct ScanDir {
+  ScanJob* job;
+  ScanOpen* parent;
+  string dir, name;
+  int depth;
+  ScanDir(ScanJob* j, ScanOpen* p, const string& d, const char* n, int dp):
+      job(j), parent(p), dir(d), name(n), depth(dp) {}
+};
+
+// List one directory of a ScanJob and submit its subdirectories
+void scanTask(void* arg, int w) {
+  ScanDir* sd=(ScanDir*)arg;
+  ScanJob& job=*sd->job;
+  Jidac& jd=job.jd;
+  const string dir=sd->dir;
+  const int depth=sd->depth;
+  int fd;
+  if (sd->parent) {
+    fd=openat(dirfd(sd->parent->dirp), sd->name.c_str(),
+              O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+    unref(job, sd->parent);
+  }
+  else
+    fd=open(dir.c_str(), O_RDONLY|O_DIRECTORY);
+  delete sd;
+  assert(w>=0 && w<int(job.found.size()));
+  vector<pair<string, DT> >& found=job.found[w];
+  DIR* dirp=fd<0 ? 0 : fdopendir(fd);
+  if (dirp) {
+    ScanOpen* self=new ScanOpen(dirp);
+    for (dirent* dp=readdir(dirp); dp; dp=readdir(dirp)) {
+      if (!strcmp(".", dp->d_name) || !strcmp("..", dp->d_name))
+        continue;
+      string fn=dir;
+      if (fn!="/") fn+="/";
+      fn+=dp->d_name;
+
+      // Don't scan files and directories excluded by -not
+      bool excluded=false;
+      for (unsigned i=0; i<jd.notfiles.size() && !excluded; ++i)
+        excluded=ispath(jd.notfiles[i].c_str(), fn.c_str());
+      if (excluded) continue;
+
+      // Save regular files and directories
+      struct stat sb;
+      if (fstatat(fd, dp->d_name, &sb, AT_SYMLINK_NOFOLLOW)) {
+        lock(job.mutex);
+        perror(fn.c_str());
+        release(job.mutex);
+        continue;
+      }
+      DT d;
+      d.date=decimal_time(sb.st_mtime);
+      d.attr=jd.noattributes ? 0 : 'u'+(int64_t(sb.st_mode)<<8);
+      if (S_ISREG(sb.st_mode)) {
+        d.size=sb.st_size;
+        if (jd.isselected(fn.c_str(), false))
+          found.push_back(std::make_pair(fn, d));
+      }
+      else if (S_ISDIR(sb.st_mode)) {
+        lock(job.mutex);
+        ++self->refs;
+        release(job.mutex);
+        job.ex.submit(scanTask,
+            new ScanDir(&job, self, fn, dp->d_name, depth+1), depth+1, w);
+        fn+="/";
+        if (jd.isselected(fn.c_str(), false))
+          found.push_back(std::make_pair(fn, d));
+      }
+    }
+    unref(job, self);
+  }
+  else {
+    if (fd>=0) close(fd);
+    lock(job.mutex);
+    perror(dir.c_str());
+    release(job.mutex);
+  }
+}
+
+#endif
+
 // Insert external filename (UTF-8 with "/") into dt if selected
 // by files, onlyfiles, and notfiles. If filename
 // is a directory then also insert its contents.
@@ -1718,24 +2187,19 @@ void Jidac::scandir(string filename) {
       addfile(filename, decimal_time(sb.st_mtime), sb.st_size,
               'u'+(sb.st_mode<<8));
 
-    // Traverse directory
+    // Traverse directory in parallel
     if (S_ISDIR(sb.st_mode)) {
       addfile(filename=="/" ? "/" : filename+"/", decimal_time(sb.st_mtime),
               0, 'u'+(int64_t(sb.st_mode)<<8));
-      DIR* dirp=opendir(filename.c_str());
-      if (dirp) {
-        for (dirent* dp=readdir(dirp); dp; dp=readdir(dirp)) {
-          if (strcmp(".", dp->d_name) && strcmp("..", dp->d_name)) {
-            string s=filename;
-            if (s!="/") s+="/";
-            s+=dp->d_name;
-            scandir(s);
-          }
+      ScanJob job(*this, *executor);
+      executor->submit(scanTask, new ScanDir(&job, 0, filename, "", 0));
+      executor->wait();
+      for (unsigned i=0; i<job.found.size(); ++i) {
+        for (unsigned j=0; j<job.found[i].size(); ++j) {
+          DT& d=edt[job.found[i][j].first];
+          d=job.found[i][j].second;
         }
-        closedir(dirp);
       }
-      else
-        perror(filename.c_str());
     }
   }
   else
@@ -1829,23 +2293,29 @@ void print_progress(int64_t ts, int64_t td, int sum) {
 }
 
 // A CompressJob is a queue of blocks to compress and write to the archive.
-// Each block cycles through states EMPTY, FILLING, FULL, COMPRESSING,
-// COMPRESSED, WRITING. The main thread waits for EMPTY buffers and
-// fills them. A set of compressThreads waits for FULL threads and compresses
-// them. A writeThread waits for COMPRESSED buffers at the front
+// Each block cycles through states EMPTY, FULL, COMPRESSING,
+// COMPRESSED, WRITING. The main thread waits for EMPTY buffers, fills
+// them, and submits a compressTask for each to an Executor, largest
+// blocks first. With -memory, a FULL block that does not fit in the
+// budget is held and submitted again when another block finishes.
+// Without -memory, each worker keeps a Compressor so that its next
+// block can reuse the model memory. A writeThread waits for COMPRESSED buffers at the front
 // of the queue and writes and removes them.
 
+class CompressJob;
+
 // Buffer queue element
 struct CJ {
   enum {EMPTY, FULL, COMPRESSING, COMPRESSED, WRITING} state;
+  CompressJob* job;      // queue containing this element
   StringBuffer in;       // uncompressed input
   StringBuffer out;      // compressed output
   string filename;       // to write in filename field
   string comment;        // if "" use default
   string method;         // compression level or "" to mark end of data
-  Semaphore full;        // 1 if in is FULL of data ready to compress
+  double mem;            // estimated memory to compress with -memory
   Semaphore compressed;  // 1 if out contains COMPRESSED data
-  CJ(): state(EMPTY) {}
+  CJ(): state(EMPTY), job(0), mem(0) {}
 };
 
 // Instructions to a compression job
@@ -1853,36 +2323,41 @@ class CompressJob {
 public:
   Mutex mutex;           // protects state changes
 private:
-  int job;               // number of jobs
+  Executor& ex;          // runs compressTasks
   CJ* q;                 // buffer queue
   unsigned qsize;        // number of elements in q
   int front;             // next to remove from queue
   libzpaq::Writer* out;  // archive
+  int autotime;          // -auto time budget in ms per MB, or 0
+  double memlimit;       // -memory budget in bytes, or 0
+  double memused;        // estimated memory of blocks being compressed
+  vector<CJ*> held;      // FULL blocks waiting for memory
+  libzpaq::Compressor* co;  // per worker to reuse models, 0 with -memory
+  int active;            // number of blocks submitted, not compressed
   Semaphore empty;       // number of empty buffers ready to fill
-  Semaphore compressors; // number of compressors available to run
 public:
-  friend ThreadReturn compressThread(void* arg);
+  friend void compressTask(void* arg, int worker);
   friend ThreadReturn writeThread(void* arg);
-  CompressJob(int threads, int buffers, libzpaq::Writer* f):
-      job(0), q(0), qsize(buffers), front(0), out(f) {
+  CompressJob(Executor& e, int buffers, libzpaq::Writer* f, int at=0,
+              double ml=0):
+      ex(e), q(0), qsize(buffers), front(0), out(f), autotime(at),
+      memlimit(ml), memused(0), co(0), active(0) {
     q=new CJ[buffers];
     if (!q) throw std::bad_alloc();
+    if (memlimit==0) co=new libzpaq::Compressor[e.size()];
     init_mutex(mutex);
     empty.init(buffers);
-    compressors.init(threads);
     for (int i=0; i<buffers; ++i) {
-      q[i].full.init(0);
+      q[i].job=this;
       q[i].compressed.init(0);
     }
   }
   ~CompressJob() {
-    for (int i=qsize-1; i>=0; --i) {
+    for (int i=qsize-1; i>=0; --i)
       q[i].compressed.destroy();
-      q[i].full.destroy();
-    }
-    compressors.destroy();
     empty.destroy();
     destroy_mutex(mutex);
+    delete[] co;
     delete[] q;
   }      
   void write(StringBuffer& s, const char* filename, string method,
@@ -1890,78 +2365,161 @@ public:
   vector<int> csize;  // compressed block sizes
 };
 
-// Write s at the back of the queue. Signal end of input with method=""
+void compressTask(void* arg, int worker);
+
+// Write s at the back of the queue and submit it to be compressed.
+// Signal end of input with method="".
 void CompressJob::write(StringBuffer& s, const char* fn, string method,
                         const char* comment) {
-  for (unsigned k=(method=="")?qsize:1; k>0; --k) {
-    empty.wait();
-    lock(mutex);
-    unsigned i, j;
-    for (i=0; i<qsize; ++i) {
-      if (q[j=(i+front)%qsize].state==CJ::EMPTY) {
-        q[j].filename=fn?fn:"";
-        q[j].comment=comment?comment:"jDC\x01";
-        q[j].method=method;
-        q[j].in.resize(0);
-        q[j].in.swap(s);
-        q[j].state=CJ::FULL;
-        q[j].full.signal();
-        break;
-      }
+  empty.wait();
+  lock(mutex);
+  unsigned i, j=0;
+  for (i=0; i<qsize; ++i) {
+    if (q[j=(i+front)%qsize].state==CJ::EMPTY) {
+      q[j].filename=fn?fn:"";
+      q[j].comment=comment?comment:"jDC\x01";
+      q[j].method=method;
+      q[j].in.resize(0);
+      q[j].in.swap(s);
+      q[j].state=CJ::FULL;
+      if (method!="") ++active;
+      break;
     }
-    release(mutex);
-    assert(i<qsize);  // queue should not be full
   }
+  release(mutex);
+  if (i>=qsize) error("compress queue full");
+  if (method=="") q[j].compressed.signal();
+  else ex.submit(compressTask, &q[j], q[j].in.size());
 }
 
-// Compress data in the background, one per buffer
-ThreadReturn compressThread(void* arg) {
-  CompressJob& job=*(CompressJob*)arg;
-  int jobNumber=0;
-  try {
+// -auto compresses SLICES evenly spaced slices of SLICE bytes of a block
+// with up to CANDIDATES levels
+enum {SLICES=4, SLICE=1<<18, CANDIDATES=3};
+
+// Put in m[] the methods that -auto tries for a block of n bytes with
+// method "LB,R,t": levels L, L-1, and L-2 (but at least 1) if L is
+// 2..5 and the block has at least SLICES*SLICE bytes. Return how many.
+int autoCandidates(const string& method, unsigned n, string m[]) {
+  const int level=isdigit(method[0]) ? method[0]-'0' : 0;
+  if (level<2 || level>5 || n<SLICES*SLICE) return 0;
+  int nc=0;
+  for (int lv=level; lv>=1 && nc<CANDIDATES; --lv, ++nc) {
+    m[nc]=method;
+    m[nc][0]='0'+lv;
+  }
+  return nc;
+}
 
-    // Get job number = assigned position in queue
-    lock(job.mutex);
-    jobNumber=job.job++;
-    assert(jobNumber>=0 && jobNumber<int(job.qsize));
-    CJ& cj=job.q[jobNumber];
-    release(job.mutex);
+// Select a method for -auto. method is as passed to compressBlock().
+// Compress the slices of in with each autoCandidates() level and
+// estimate the size and time to compress all of in with each. Of the
+// levels that fit in the time budget of autotime CPU ms per MB, return
+// the fastest one that is within 1% of the smallest size. If none
+// fit, return the fastest level.
+string autoMethod(StringBuffer& in, const string& method, int autotime) {
+  const unsigned n=in.size();
+  string m[CANDIDATES];
+  const int nc=autoCandidates(method, n, m);
+  if (nc==0) return method;
+  StringBuffer sample(SLICES*SLICE);
+  for (int i=0; i<SLICES; ++i)
+    sample.write(in.c_str()+(n-SLICE)/(SLICES-1)*i, SLICE);
+
+  // Trial compress each candidate level
+  double size[CANDIDATES], time[CANDIDATES];
+  for (int i=0; i<nc; ++i) {
+    StringBuffer tmp(sample.size());  // compressBlock might modify input
+    tmp.write(sample.c_str(), sample.size());
+    CountWriter cw;
+    const double start=threadTime();
+    libzpaq::compressBlock(&tmp, &cw, m[i].c_str(), "", 0, false);
+    time[i]=(threadTime()-start+1.0)*n/sample.size();
+    size[i]=double(cw.n)*n/sample.size();
+  }
 
-    // Work until done
-    while (true) {
-      cj.full.wait();
-      lock(job.mutex);
+  // Pick a level
+  const double budget=autotime*(n/1000000.0);
+  int best=-1, fastest=0;
+  for (int i=0; i<nc; ++i) {
+    if (time[i]<time[fastest]) fastest=i;
+    if (time[i]<=budget && (best<0 || size[i]<size[best])) best=i;
+  }
+  if (best<0) return m[fastest];
+  for (int i=0; i<nc; ++i)
+    if (time[i]<=budget && time[i]<time[best] && size[i]<=size[best]*1.01)
+      best=i;
+  return m[best];
+}
 
-      // Check for end of input
-      if (cj.method=="") {
-        cj.compressed.signal();
-        release(job.mutex);
-        return 0;
-      }
+// Estimate the memory to compress in with method, limiting the index
+// to maxmem, including the input, and with autotime, the -auto trials
+// and every level they might select.
+double blockMemory(StringBuffer& in, const string& method, int autotime,
+                   double maxmem) {
+  double mem=libzpaq::compressBlockMemory(&in, method.c_str(), maxmem);
+  string m[CANDIDATES];
+  const int nc=autotime>0 ? autoCandidates(method, in.size(), m) : 0;
+  for (int i=1; i<nc; ++i)
+    mem=max(mem, libzpaq::compressBlockMemory(&in, m[i].c_str(), maxmem));
+  if (nc>0) mem+=2*SLICES*SLICE;  // sample and its copy
+  return mem+in.size();
+}
 
-      // Compress
-      assert(cj.state==CJ::FULL);
-      cj.state=CJ::COMPRESSING;
-      release(job.mutex);
-      job.compressors.wait();
-      libzpaq::compressBlock(&cj.in, &cj.out, cj.method.c_str(),
-          cj.filename.c_str(), cj.comment=="" ? 0 : cj.comment.c_str());
-      cj.in.resize(0);
-      lock(job.mutex);
-      cj.state=CJ::COMPRESSED;
-      cj.compressed.signal();
-      job.compressors.signal();
+// Compress one FULL buffer, a CJ
+void compressTask(void* arg, int worker) {
+  CJ& cj=*(CJ*)arg;
+  CompressJob& job=*cj.job;
+  const double maxmem=job.memlimit>0 ? job.memlimit/job.ex.size() : 0;
+
+  // With -memory, start only if the estimated memory fits in the budget
+  // or no other block is compressing. Otherwise hold the block, freeing
+  // this worker, until another block finishes. A block that would exceed
+  // a per-thread share uses a smaller index.
+  if (job.memlimit>0 && cj.mem==0)
+    cj.mem=blockMemory(cj.in, cj.method, job.autotime, maxmem);
+  lock(job.mutex);
+  if (cj.state==CJ::FULL) {
+    if (job.memused>0 && job.memused+cj.mem>job.memlimit) {
+      job.held.push_back(&cj);
       release(job.mutex);
+      return;
     }
+    job.memused+=cj.mem;
+    cj.state=CJ::COMPRESSING;
   }
-  catch (std::exception& e) {
-    lock(job.mutex);
-    fflush(stdout);
-    fprintf(stderr, "job %d: %s\n", jobNumber+1, e.what());
-    release(job.mutex);
-    exit(1);
+  release(job.mutex);
+  if (job.autotime>0 && isdigit(cj.method[0]))
+    cj.method=autoMethod(cj.in, cj.method, job.autotime);
+
+  // Workers not needed by other blocks may help sort suffixes
+  lock(job.mutex);
+  const int threads=max(1, job.ex.size()/max(1, job.active));
+  release(job.mutex);
+  libzpaq::compressBlock(&cj.in, &cj.out, cj.method.c_str(),
+      cj.filename.c_str(), cj.comment=="" ? 0 : cj.comment.c_str(),
+      true, threads, maxmem, job.co ? &job.co[worker] : 0);
+  cj.in.resize(0);
+
+  // Release memory and submit the held blocks that now fit
+  vector<CJ*> start;
+  lock(job.mutex);
+  --job.active;
+  cj.state=CJ::COMPRESSED;
+  cj.compressed.signal();
+  job.memused-=cj.mem;
+  cj.mem=0;
+  for (unsigned i=0; i<job.held.size(); ++i) {
+    CJ* h=job.held[i];
+    if (job.memused==0 || job.memused+h->mem<=job.memlimit) {
+      job.memused+=h->mem;
+      h->state=CJ::COMPRESSING;
+      start.push_back(h);
+      job.held.erase(job.held.begin()+i--);
+    }
   }
-  return 0;
+  release(job.mutex);
+  for (unsigned i=0; i<start.size(); ++i)
+    job.ex.submit(compressTask, start[i], start[i]->in.size());
 }
 
 // Write compressed data to the archive in the background
@@ -2101,6 +2659,423 @@ struct WriterPair: public libzpaq::Writer {
   WriterPair(): a(0), b(0) {}
 };
 
+// A FragmentJob reads the files to be added, splits them into fragments
+// and computes their SHA-1 hashes in a set of fragmentThreads while the
+// main thread dedupes the fragments and packs them into blocks in the
+// original file order. File fi is assigned to thread fi%nthreads. Each
+// thread passes its fragments to the main thread in a queue of FQ
+// elements, the last fragment of each file marked with eof=1.
+//
+// Each thread reads its files in large chunks alternately into 2 input
+// buffers, and fragments point into them rather than being copied.
+// Before a buffer is refilled, the thread waits until the main thread
+// has released all fragments pointing into it. The unfinished fragment
+// at the end of one buffer is copied to the start of the other.
+//
+// Fragment boundaries are found by one of two chunkers. The default
+// is a rolling hash of bytes that are correctly predicted by an order 1
+// context. With -chunker fastcdc, boundaries are found with FastCDC:
+// the first minfrag bytes are skipped without hashing, then a gear
+// hash is tested with a harder mask up to the average fragment size
+// and with an easier mask after that to make sizes more uniform.
+//
+// In Unix, a prefetchThread asks the OS to start reading the first
+// chunk of the next PREFETCH files ahead of the ones being opened so
+// that open and seek latency overlaps with hashing.
+
+// A fragment of an input file
+struct FB {
+  const char* buf;           // contents, points into FQ::rbuf[part]
+  unsigned sz;               // size of buf
+  unsigned hits;             // correct order 1 predictions
+  int eof;                   // 1 if last fragment, -1 if file not opened
+  int part;                  // input buffer 0..1, or -1 if none
+  char sha1result[20];       // hash of buf[0..sz-1]
+  unsigned char o1[256];     // order 1 context -> predicted byte
+  FB(): buf(""), sz(0), hits(0), eof(0), part(-1) {}
+};
+
+// Fragment queue and input buffers of one thread
+struct FQ {
+  enum {SIZE=64};            // queue size
+  FB f[SIZE];                // filled in order
+  unsigned front, back;      // next to remove, fill
+  bool ready;                // true if f[front] was waited for
+  Semaphore empty;           // number of elements ready to fill
+  Semaphore full;            // number of fragments ready to dedupe
+  libzpaq::Array<char> rbuf[2];  // input buffers
+  unsigned used[2];          // number of fragments pointing to rbuf[i]
+  Semaphore freed[2];        // signaled when a fragment in rbuf[i] is popped
+  FQ(): front(0), back(0), ready(false) {used[0]=used[1]=0;}
+};
+
+class FragmentJob {
+public:
+  Mutex mutex;               // protects job
+private:
+  int job;                   // number of threads started
+  int nthreads;              // number of threads and queues
+  FQ* q;                     // queue for each thread
+  vector<DTMap::iterator>& vf;  // files to read
+  const int fragment;        // log average fragment size - 4K
+  const unsigned minfrag, maxfrag;  // fragment size limits
+  unsigned chunk;            // size of each input buffer
+  const bool fastcdc;        // use FastCDC chunker?
+  uint64_t gear[256];        // FastCDC hash table
+  Semaphore ahead;           // files that may be prefetched
+  unsigned cdc(const char* p, unsigned n) const;  // FastCDC boundary
+public:
+  enum {PREFETCH=32};        // number of files to prefetch
+  friend ThreadReturn fragmentThread(void* arg);
+  friend ThreadReturn prefetchThread(void* arg);
+  FragmentJob(vector<DTMap::iterator>& vf_, int threads, int fragment_,
+              unsigned minfrag_, unsigned maxfrag_, bool fastcdc_):
+      job(0), nthreads(threads), q(0), vf(vf_), fragment(fragment_),
+      minfrag(minfrag_), maxfrag(maxfrag_), chunk(1<<22),
+      fastcdc(fastcdc_) {
+    if (chunk<maxfrag*4) chunk=maxfrag*4;
+    if (nthreads>int(vf.size())) nthreads=vf.size();
+    if (nthreads<1) nthreads=1;
+    while (nthreads>1 && uint64_t(nthreads)*chunk*2>(1u<<29))
+      --nthreads;
+
+    // Fill gear[] with fixed pseudo-random numbers (splitmix64) so that
+    // the same data is always split the same way
+    uint64_t x=0;
+    for (int i=0; i<256; ++i) {
+      uint64_t z=(x+=0x9e3779b97f4a7c15ull);
+      z=(z^(z>>30))*0xbf58476d1ce4e5b9ull;
+      z=(z^(z>>27))*0x94d049bb133111ebull;
+      gear[i]=z^(z>>31);
+    }
+    q=new FQ[nthreads];
+    if (!q) throw std::bad_alloc();
+    init_mutex(mutex);
+    ahead.init(PREFETCH);
+    for (int i=0; i<nthreads; ++i) {
+      q[i].empty.init(FQ::SIZE);
+      q[i].full.init(0);
+      for (int j=0; j<2; ++j) q[i].freed[j].init(0);
+    }
+  }
+  ~FragmentJob() {
+    for (int i=nthreads-1; i>=0; --i) {
+      for (int j=1; j>=0; --j) q[i].freed[j].destroy();
+      q[i].full.destroy();
+      q[i].empty.destroy();
+    }
+    ahead.destroy();
+    destroy_mutex(mutex);
+    delete[] q;
+  }
+  int size() const {return nthreads;}
+
+  // Wait for the next fragment of file fi and return it
+  FB& get(unsigned fi) {
+    FQ& fq=q[fi%nthreads];
+    if (!fq.ready) fq.full.wait(), fq.ready=true;
+    return fq.f[fq.front];
+  }
+
+  // Release the fragment returned by get(fi)
+  void pop(unsigned fi) {
+    FQ& fq=q[fi%nthreads];
+    assert(fq.ready);
+    const int part=fq.f[fq.front].part;
+    fq.front=(fq.front+1)%FQ::SIZE;
+    fq.ready=false;
+    fq.empty.signal();
+    if (part>=0) fq.freed[part].signal();
+  }
+};
+
+// Return the size of the first fragment of p[0..n-1] found by FastCDC.
+// If n>=maxfrag then the result is at most maxfrag, else n if no
+// boundary is found.
+unsigned FragmentJob::cdc(const char* p, unsigned n) const {
+  if (n>maxfrag) n=maxfrag;
+  if (n<=minfrag || fragment>22) return n;
+  const int bits=10+fragment;  // log2 average fragment size
+  const uint64_t mask1=~(~0ull>>(bits+2));  // before average size
+  const uint64_t mask2=~(~0ull>>(bits-2));  // after average size
+  unsigned avg=1u<<bits;
+  if (avg<minfrag) avg=minfrag;
+  if (avg>n) avg=n;
+  const unsigned char* q=(const unsigned char*)p;
+  uint64_t h=0;
+  unsigned i=minfrag;
+  for (; i<avg; ++i) {
+    h=(h<<1)+gear[q[i]];
+    if (!(h&mask1)) return i+1;
+  }
+  for (; i<n; ++i) {
+    h=(h<<1)+gear[q[i]];
+    if (!(h&mask2)) return i+1;
+  }
+  return n;
+}
+
+// Read and fragment every nthreads'th file in the background
+ThreadReturn fragmentThread(void* arg) {
+  FragmentJob& job=*(FragmentJob*)arg;
+  int jobNumber=0;
+  try {
+
+    // Get job number = assigned queue
+    lock(job.mutex);
+    jobNumber=job.job++;
+    assert(jobNumber>=0 && jobNumber<job.nthreads);
+    FQ& fq=job.q[jobNumber];
+    release(job.mutex);
+    for (int i=0; i<2; ++i) fq.rbuf[i].resize(job.chunk);
+    int part=0;  // input buffer in use
+
+    for (unsigned fi=jobNumber; fi<job.vf.size(); fi+=job.nthreads) {
+
+      // Open input file and allow one more to be prefetched
+      FP in=fopen(job.vf[fi]->first.c_str(), RB);
+      job.ahead.signal();
+      if (in==FPNULL) {
+        lock(job.mutex);
+        printerr(job.vf[fi]->first.c_str());
+        release(job.mutex);
+        fq.empty.wait();
+        FB& f=fq.f[fq.back];
+        f.buf="";
+        f.sz=0;
+        f.eof=-1;
+        f.part=-1;
+        fq.back=(fq.back+1)%FQ::SIZE;
+        fq.full.signal();
+        continue;
+      }
+#ifdef unix
+#ifdef POSIX_FADV_SEQUENTIAL
+      posix_fadvise(fileno(in), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+
+      // Read fragments
+      unsigned rptr=0, rlen=0;  // fragment start and end of data in rbuf
+      bool ineof=false;  // read to end of file?
+      bool first=true;  // no data read yet?
+      int c=EOF;  // EOF if last fragment
+      do {
+        fq.empty.wait();
+        FB& f=fq.f[fq.back];
+
+        // Keep at least maxfrag bytes after rptr until end of file.
+        // Move the partial fragment to the other buffer and fill it.
+        if ((rlen-rptr<job.maxfrag && !ineof) || first) {
+          const int next=part^1;
+          for (; fq.used[next]>0; --fq.used[next]) fq.freed[next].wait();
+          if (rlen>rptr)
+            memcpy(&fq.rbuf[next][0], &fq.rbuf[part][rptr], rlen-rptr);
+          rlen-=rptr;
+          rptr=0;
+          part=next;
+          const unsigned n=job.chunk-rlen;
+          const unsigned r=fread(&fq.rbuf[part][rlen], 1, n, in);
+          rlen+=r;
+          ineof=r<n;
+          first=false;
+        }
+        const unsigned char* p=(const unsigned char*)&fq.rbuf[part][rptr];
+        const unsigned n=rlen-rptr;  // bytes available
+        unsigned sz=0;  // fragment size
+        unsigned hits=0;  // correct prediction count
+        int c1=0;  // previous byte
+        memset(f.o1, 0, sizeof(f.o1));
+
+        // Find boundary with FastCDC and update o1
+        if (job.fastcdc) {
+          sz=job.cdc((const char*)p, n);
+          for (unsigned i=0; i<sz; ++i) {
+            c=p[i];
+            if (c==f.o1[c1]) ++hits;
+            f.o1[c1]=c;
+            c1=c;
+          }
+          c=(ineof && sz==n) ? EOF : 0;
+        }
+
+        // Find boundary with rolling hash. Stop at EOF if not found.
+        else {
+          unsigned h=0;  // rolling hash for finding fragment boundaries
+          c=EOF;
+          while (sz<n) {
+            const int c2=p[sz++];
+            if (c2==f.o1[c1]) h=(h+c2+1)*314159265u, ++hits;
+            else h=(h+c2+1)*271828182u;
+            f.o1[c1]=c2;
+            c1=c2;
+            if (sz>=job.maxfrag
+                || (job.fragment<=22 && h<(1u<<(22-job.fragment))
+                    && sz>=job.minfrag)) {
+              c=0;
+              break;
+            }
+          }
+        }
+        assert(sz<=job.maxfrag);
+        assert(sz<=n);
+        assert(c==EOF || sz>0);
+        libzpaq::SHA1 sha1;
+        sha1.write((const char*)p, sz);
+        memcpy(f.sha1result, sha1.result(), 20);
+        f.buf=(const char*)p;
+        f.sz=sz;
+        f.hits=hits;
+        f.eof=(c==EOF);
+        f.part=part;
+        ++fq.used[part];
+        rptr+=sz;
+        fq.back=(fq.back+1)%FQ::SIZE;
+        fq.full.signal();
+      } while (c!=EOF);
+      fclose(in);
+    }
+  }
+  catch (std::exception& e) {
+    lock(job.mutex);
+    fflush(stdout);
+    fprintf(stderr, "zpaq exiting from fragmentThread %d: %s\n",
+        jobNumber+1, e.what());
+    release(job.mutex);
+    exit(1);
+  }
+  return 0;
+}
+
+// Hint the OS to read the start of files not yet opened by
+// fragmentThreads, staying at most PREFETCH files ahead.
+// The first nthreads files are opened right away.
+ThreadReturn prefetchThread(void* arg) {
+  FragmentJob& job=*(FragmentJob*)arg;
+  for (unsigned fi=job.nthreads; fi<job.vf.size(); ++fi) {
+    job.ahead.wait();
+#ifdef unix
+    int fd=open(job.vf[fi]->first.c_str(), O_RDONLY);
+    if (fd<0) continue;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, job.chunk, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+#endif
+  }
+  return 0;
+}
+
+// A SketchJob computes a MinHash sketch of the first SAMPLE bytes of
+// each file to be added so that files with similar contents can be
+// grouped into the same block. The sketch uses one permutation hashing:
+// each 8 byte string is hashed, the top 4 bits of the hash select one
+// of K bins, and each bin keeps the smallest hash. Two files with
+// Jaccard similarity J agree in each bin with probability about J.
+struct SketchJob {
+  enum {K=16, SAMPLE=1<<20, MINSIZE=1024, BUFSIZE=1<<16};
+  vector<DTMap::iterator>& vf;    // files to sketch
+  vector<uint64_t> sk;            // sketch of vf[i] is sk[i*K..i*K+K-1]
+  vector<string> buf;             // input buffer by worker
+  SketchJob(vector<DTMap::iterator>& vf_, int workers):
+      vf(vf_), sk(vf_.size()*K, ~0ull), buf(workers) {}
+};
+
+// Argument to sketchTask: sketch file vf[fi]
+struct SketchTask {
+  SketchJob* job;
+  unsigned fi;
+};
+
+// Sketch one file of a SketchJob. Files that cannot be read are left
+// with all bins empty.
+void sketchTask(void* arg, int worker) {
+  SketchJob& job=*((SketchTask*)arg)->job;
+  const unsigned fi=((SketchTask*)arg)->fi;
+  string& buf=job.buf[worker];
+  if (buf.size()==0) buf.resize(SketchJob::BUFSIZE);
+  FP in=fopen(job.vf[fi]->first.c_str(), RB);
+  if (in==FPNULL) return;
+  uint64_t* sk=&job.sk[fi*SketchJob::K];
+  uint64_t w=0;  // last 8 bytes
+  int len=0;     // number of bytes read
+  for (int n=0; len<SketchJob::SAMPLE
+       && (n=fread(&buf[0], 1, SketchJob::BUFSIZE, in))>0;) {
+    for (int i=0; i<n; ++i, ++len) {
+      w=w<<8|(buf[i]&255);
+      if (len<7) continue;
+      uint64_t x=w*0x9e3779b97f4a7c15ull;
+      x^=x>>29;
+      x*=0xbf58476d1ce4e5b9ull;
+      x^=x>>32;
+      uint64_t& b=sk[x>>60];
+      if (x<<4<b) b=x<<4;
+    }
+  }
+  fclose(in);
+}
+
+// Return the root of i in the union-find forest p. Roots are the
+// lowest index in their set.
+static unsigned findRoot(vector<unsigned>& p, unsigned i) {
+  while (p[i]!=i) i=p[i]=p[p[i]];
+  return i;
+}
+
+// Reorder vf so that files with similar sketches are added together.
+// Files that agree in all 4 bins of any of 4 bands of their sketches
+// are put in the same group, and each group is moved to the position
+// of its first file in the original order.
+// Files smaller than MINSIZE are not sketched.
+void groupSimilar(vector<DTMap::iterator>& vf, Executor& ex) {
+  if (vf.size()<3) return;
+  SketchJob job(vf, ex.size());
+  vector<SketchTask> task(vf.size());
+  for (unsigned i=0; i<vf.size(); ++i) {
+    task[i].job=&job;
+    task[i].fi=i;
+    if (vf[i]->second.size>=SketchJob::MINSIZE)
+      ex.submit(sketchTask, &task[i],
+                double(min(vf[i]->second.size, int64_t(SketchJob::SAMPLE))));
+  }
+  ex.wait();
+
+  // Join files sharing a band
+  const int BANDS=4, ROWS=SketchJob::K/BANDS;
+  vector<unsigned> parent(vf.size());
+  for (unsigned i=0; i<vf.size(); ++i) parent[i]=i;
+  map<uint64_t, unsigned> first;  // band hash -> first file with it
+  for (unsigned i=0; i<vf.size(); ++i) {
+    const uint64_t* sk=&job.sk[i*SketchJob::K];
+    for (int b=0; b<BANDS; ++b) {
+      uint64_t h=b+1;
+      bool empty=false;
+      for (int j=b*ROWS; j<b*ROWS+ROWS; ++j) {
+        if (sk[j]==~0ull) empty=true;
+        h=(h+sk[j])*0x9e3779b97f4a7c15ull;
+      }
+      if (empty) continue;
+      map<uint64_t, unsigned>::iterator p=first.find(h);
+      if (p==first.end()) first[h]=i;
+      else {
+        const unsigned r1=findRoot(parent, p->second);
+        const unsigned r2=findRoot(parent, i);
+        if (r1<r2) parent[r2]=r1;
+        else parent[r1]=r2;
+      }
+    }
+  }
+
+  // Stable sort by group
+  vector<pair<unsigned, unsigned> > order(vf.size());
+  for (unsigned i=0; i<vf.size(); ++i)
+    order[i]=std::make_pair(findRoot(parent, i), i);
+  std::sort(order.begin(), order.end());
+  vector<DTMap::iterator> v(vf.size());
+  for (unsigned i=0; i<vf.size(); ++i) v[i]=vf[order[i].second];
+  vf.swap(v);
+}
+
 // Add or delete files from archive. Return 1 if error else 0.
 int Jidac::add() {
 
@@ -2245,6 +3220,7 @@ int Jidac::add() {
     }
   }
   std::sort(vf.begin(), vf.end(), compareFilename);
+  if (group) groupSimilar(vf, *executor);
 
   // Test for reliable access to archive
   if (archive_exists!=exists(subpart(archive, 1).c_str()))
@@ -2254,15 +3230,18 @@ int Jidac::add() {
   OutputArchive out(arcname.c_str(), password, salt, offset);
   out.seek(header_pos, SEEK_SET);
 
-  // Start compress and write jobs
-  vector<ThreadID> tid(threads*2-1);
+  // Start compress and write jobs. With -memory, limit the blocks
+  // waiting to be compressed to half of the budget.
+  const double memlimit=memory*double(1<<20);
+  int buffers=threads*2-1;
+  if (memlimit>0 && buffers*2.0*blocksize>memlimit)
+    buffers=max(1, int(memlimit/2/blocksize));
   ThreadID wid;
-  CompressJob job(threads, tid.size(), &out);
+  CompressJob job(*executor, buffers, &out, autotime, memlimit);
   printf(
       "Adding %1.6f MB in %d files -method %s -threads %d at %s.\n",
       total_size/1000000.0, int(vf.size()), method.c_str(), threads,
       dateToString(date).c_str());
-  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], compressThread, &job);
   run(wid, writeThread, &job);
 
   // Append in streaming mode. Each file is a separate block. Large files
@@ -2285,12 +3264,21 @@ int Jidac::add() {
         ++errors;
         continue;
       }
+#ifdef unix
+#ifdef POSIX_FADV_SEQUENTIAL
+      posix_fadvise(fileno(in), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+
+      // Read directly into sb up to blocksize bytes at a time
       uint64_t i=0;
-      const int BUFSIZE=4096;
-      char buf[BUFSIZE];
+      const unsigned BUFSIZE=4096;
       while (true) {
-        int r=fread(buf, 1, BUFSIZE, in);
-        sb.write(buf, r);
+        const unsigned old=sb.size();
+        const unsigned n=blocksize-old;
+        sb.write(0, n);
+        const unsigned r=fread(sb.data()+old, 1, n, in);
+        sb.resize(old+r);
         i+=r;
         if (r==0 || sb.size()+BUFSIZE>blocksize) {
           string filename="";
@@ -2315,7 +3303,6 @@ int Jidac::add() {
 
     // Wait for jobs to finish
     job.write(sb, 0, "");  // signal end of input
-    for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
     join(wid);
 
     // Done
@@ -2356,26 +3343,29 @@ int Jidac::add() {
   unsigned exe=0;      // number of fragments containing x86 (exe, dll)
   const int ON=4;      // number of order-1 tables to save
   unsigned char o1prev[ON*256]={0};  // last ON order 1 predictions
-  libzpaq::Array<char> fragbuf(MAX_FRAGMENT);
   vector<unsigned> blocklist;  // list of starting fragments
 
+  // Start reading and fragmenting input files
+  FragmentJob fjob(vf, threads, fragment, MIN_FRAGMENT, MAX_FRAGMENT,
+                   fastcdc);
+  vector<ThreadID> fid(fjob.size());
+  for (unsigned i=0; i<fid.size(); ++i) run(fid[i], fragmentThread, &fjob);
+#ifdef unix
+  ThreadID pid;
+  run(pid, prefetchThread, &fjob);
+#endif
+
   // For each file to be added
   for (unsigned fi=0; fi<=vf.size(); ++fi) {
-    FP in=FPNULL;
-    const int BUFSIZE=4096;  // input buffer
-    char buf[BUFSIZE];
-    int bufptr=0, buflen=0;  // read pointer and limit
     if (fi<vf.size()) {
       assert(vf[fi]->second.ptr.size()==0);
       DTMap::iterator p=vf[fi];
 
-      // Open input file
-      bufptr=buflen=0;
-      in=fopen(p->first.c_str(), RB);
-      if (in==FPNULL) {  // skip if not found
+      // Skip if input file could not be opened
+      if (fjob.get(fi).eof<0) {
+        fjob.pop(fi);
         p->second.date=0;
         total_size-=p->second.size;
-        printerr(p->first.c_str());
         ++errors;
         continue;
       }
@@ -2387,38 +3377,24 @@ int Jidac::add() {
     for (unsigned fj=0; true; ++fj) {
       int64_t sz=0;  // fragment size;
       unsigned hits=0;  // correct prediction count
-      int c=EOF;  // current byte
+      int c=EOF;  // EOF if last fragment
       unsigned htptr=0;  // fragment index
       char sha1result[20]={0};  // fragment hash
       unsigned char o1[256]={0};  // order 1 context -> predicted byte
+      const char* fragbuf="";  // fragment contents
       if (fi<vf.size()) {
-        int c1=0;  // previous byte
-        unsigned h=0;  // rolling hash for finding fragment boundaries
-        libzpaq::SHA1 sha1;
-        assert(in!=FPNULL);
-        while (true) {
-          if (bufptr>=buflen) bufptr=0, buflen=fread(buf, 1, BUFSIZE, in);
-          if (bufptr>=buflen) c=EOF;
-          else c=(unsigned char)buf[bufptr++];
-          if (c!=EOF) {
-            if (c==o1[c1]) h=(h+c+1)*314159265u, ++hits;
-            else h=(h+c+1)*271828182u;
-            o1[c1]=c;
-            c1=c;
-            sha1.put(c);
-            fragbuf[sz++]=c;
-          }
-          if (c==EOF
-              || sz>=MAX_FRAGMENT
-              || (fragment<=22 && h<(1u<<(22-fragment)) && sz>=MIN_FRAGMENT))
-            break;
-        }
+        FB& f=fjob.get(fi);  // wait for next fragment
+        assert(f.eof>=0);
+        sz=f.sz;
+        hits=f.hits;
+        if (!f.eof) c=0;
+        memcpy(o1, f.o1, 256);
+        fragbuf=f.buf;
         assert(sz<=MAX_FRAGMENT);
         total_done+=sz;
 
         // Look for matching fragment
-        assert(uint64_t(sz)==sha1.usize());
-        memcpy(sha1result, sha1.result(), 20);
+        memcpy(sha1result, f.sha1result, 20);
         htptr=htinv.find(sha1result);
       }  // end if fi<vf.size()
 
@@ -2522,7 +3498,7 @@ int Jidac::add() {
 
         // Append fragbuf to sb and update block statistics
         assert(sz==0 || fi<vf.size());
-        sb.write(&fragbuf[0], sz);
+        sb.write(fragbuf, sz);
         ++frags;
         redundancy+=hits;
         exe+=exe1*4;
@@ -2542,6 +3518,7 @@ int Jidac::add() {
           fsize+=sz;
         }
         vf[fi]->second.ptr.push_back(htptr);
+        fjob.pop(fi);
       }
       if (c==EOF) break;
     }  // end for each fragment fj
@@ -2563,16 +3540,16 @@ int Jidac::add() {
         if (fsize!=p->second.size) printf(" -> %1.0f", fsize+0.0);
         printf("\n");
       }
-      assert(in!=FPNULL);
-      fclose(in);
-      in=FPNULL;
     }
   }  // end for each file fi
   assert(sb.size()==0);
+  for (unsigned i=0; i<fid.size(); ++i) join(fid[i]);
+#ifdef unix
+  join(pid);
+#endif
 
   // Wait for jobs to finish
   job.write(sb, 0, "");  // signal end of input
-  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
   join(wid);
 
   // Open index
@@ -2765,306 +3742,321 @@ bool Jidac::equal(DTMap::const_iterator p, const char* filename) {
 }
 
 // An extract job is a set of blocks with at least one file pointing to them.
-// Blocks are extracted in separate threads, set READY -> WORKING.
+// Each block is extracted by a decompressTask, largest first, which sets
+// it READY -> WORKING. Each worker of the Executor keeps its own open
+// archive and output buffer.
 // A block is extracted to memory up to the last fragment that has a file
 // pointing to it. Then the checksums are verified. Then for each file
 // pointing to the block, each of the fragments that it points to within
 // the block are written in order.
 
+// Per worker state of an ExtractJob
+struct ExtractWorker {
+  InputArchive* in;         // archive opened by this worker or 0
+  StringBuffer out;         // decompressed block
+  libzpaq::Decompresser d;  // reused to keep JIT code of the same header
+  ExtractWorker(): in(0) {}
+  ~ExtractWorker() {delete in;}
+};
+
+struct ExtractJob;
+
+// A block to decompress
+struct ExtractTask {
+  ExtractJob* job;          // job it belongs to
+  unsigned k;               // index in jd.block
+};
+
 struct ExtractJob {         // list of jobs
   Mutex mutex;              // protects state
   Mutex write_mutex;        // protects writing to disk
-  int job;                  // number of jobs started
+  Executor& ex;             // runs decompressTasks
+  int killed;               // number of tasks that ran out of memory
   Jidac& jd;                // what to extract
   FP outf;                  // currently open output file
   DTMap::iterator lastdt;   // currently open output file name
   double maxMemory;         // largest memory used by any block (test mode)
   int64_t total_size;       // bytes to extract
   int64_t total_done;       // bytes extracted so far
-  ExtractJob(Jidac& j): job(0), jd(j), outf(FPNULL), lastdt(j.dt.end()),
-      maxMemory(0), total_size(0), total_done(0) {
+  ExtractWorker* worker;    // state of each worker in ex
+  vector<ExtractTask> task; // one for each block in jd.block
+  ExtractJob(Jidac& j, Executor& e): ex(e), killed(0), jd(j), outf(FPNULL),
+      lastdt(j.dt.end()), maxMemory(0), total_size(0), total_done(0),
+      worker(0) {
     init_mutex(mutex);
     init_mutex(write_mutex);
+    worker=new ExtractWorker[ex.size()];
   }
   ~ExtractJob() {
+    delete[] worker;
     destroy_mutex(mutex);
     destroy_mutex(write_mutex);
   }
 };
 
-// Decompress blocks in a job until none are READY
-ThreadReturn decompressThread(void* arg) {
-  ExtractJob& job=*(ExtractJob*)arg;
-  int jobNumber=0;
-
-  // Get job number
-  lock(job.mutex);
-  jobNumber=++job.job;
-  release(job.mutex);
+// Decompress one READY block, an ExtractTask
+void decompressTask(void* arg, int w) {
+  ExtractJob& job=*((ExtractTask*)arg)->job;
+  const int jobNumber=w+1;
+  Block& b=job.jd.block[((ExtractTask*)arg)->k];
 
   // Open archive for reading
-  InputArchive in(job.jd.archive.c_str(), job.jd.password);
-  if (!in.isopen()) return 0;
-  StringBuffer out;
-
-  // Look for next READY job.
-  int next=0;  // current job
-  while (true) {
+  ExtractWorker& ew=job.worker[w];
+  if (!ew.in) ew.in=new InputArchive(job.jd.archive.c_str(),
+      job.jd.password);
+  if (!ew.in->isopen()) {
     lock(job.mutex);
-    for (unsigned i=0; i<=job.jd.block.size(); ++i) {
-      unsigned k=i+next;
-      if (k>=job.jd.block.size()) k-=job.jd.block.size();
-      if (i==job.jd.block.size()) {  // no more jobs?
-        release(job.mutex);
-        return 0;
-      }
-      Block& b=job.jd.block[k];
-      if (b.state==Block::READY && b.size>0 && b.usize>=0) {
-        b.state=Block::WORKING;
-        release(job.mutex);
-        next=k;
-        break;
-      }
-    }
-    Block& b=job.jd.block[next];
+    b.state=Block::READY;
+    release(job.mutex);
+    return;
+  }
+  InputArchive& in=*ew.in;
+  StringBuffer& out=ew.out;
+
+  // Get uncompressed size of block
+  unsigned output_size=0;  // minimum size to decompress
+  assert(b.start>0);
+  for (unsigned j=0; j<b.size; ++j) {
+    assert(b.start+j<job.jd.ht.size());
+    assert(job.jd.ht[b.start+j].usize>=0);
+    output_size+=job.jd.ht[b.start+j].usize;
+  }
 
-    // Get uncompressed size of block
-    unsigned output_size=0;  // minimum size to decompress
+  // Decompress
+  double mem=0;  // how much memory used to decompress
+  try {
     assert(b.start>0);
-    for (unsigned j=0; j<b.size; ++j) {
-      assert(b.start+j<job.jd.ht.size());
-      assert(job.jd.ht[b.start+j].usize>=0);
-      output_size+=job.jd.ht[b.start+j].usize;
+    assert(b.start<job.jd.ht.size());
+    assert(b.size>0);
+    assert(b.start+b.size<=job.jd.ht.size());
+    in.seek(b.offset, SEEK_SET);
+    libzpaq::Decompresser& d=ew.d;
+    d.reset();
+    d.setInput(&in);
+    out.resize(0);
+    assert(b.usize>=0);
+    assert(b.usize<=0xffffffffu);
+    out.setLimit(b.usize);
+    d.setOutput(&out);
+    if (!d.findBlock(&mem)) error("archive block not found");
+    if (mem>job.maxMemory) job.maxMemory=mem;
+    while (d.findFilename()) {
+      d.readComment();
+      while (out.size()<output_size && d.decompress(1<<14));
+      lock(job.mutex);
+      print_progress(job.total_size, job.total_done, job.jd.summary);
+      if (job.jd.summary<=0)
+        printf("[%d..%d] -> %1.0f\n", b.start, b.start+b.size-1,
+            out.size()+0.0);
+      release(job.mutex);
+      if (out.size()>=output_size) break;
+      d.readSegmentEnd();
+    }
+    if (out.size()<output_size) {
+      lock(job.mutex);
+      fflush(stdout);
+      fprintf(stderr, "output [%d..%d] %d of %d bytes\n",
+           b.start, b.start+b.size-1, int(out.size()), output_size);
+      release(job.mutex);
+      error("unexpected end of compressed data");
     }
 
-    // Decompress
-    double mem=0;  // how much memory used to decompress
-    try {
-      assert(b.start>0);
-      assert(b.start<job.jd.ht.size());
-      assert(b.size>0);
-      assert(b.start+b.size<=job.jd.ht.size());
-      in.seek(b.offset, SEEK_SET);
-      libzpaq::Decompresser d;
-      d.setInput(&in);
-      out.resize(0);
-      assert(b.usize>=0);
-      assert(b.usize<=0xffffffffu);
-      out.setLimit(b.usize);
-      d.setOutput(&out);
-      if (!d.findBlock(&mem)) error("archive block not found");
-      if (mem>job.maxMemory) job.maxMemory=mem;
-      while (d.findFilename()) {
-        d.readComment();
-        while (out.size()<output_size && d.decompress(1<<14));
-        lock(job.mutex);
-        print_progress(job.total_size, job.total_done, job.jd.summary);
-        if (job.jd.summary<=0)
-          printf("[%d..%d] -> %1.0f\n", b.start, b.start+b.size-1,
-              out.size()+0.0);
-        release(job.mutex);
-        if (out.size()>=output_size) break;
-        d.readSegmentEnd();
-      }
-      if (out.size()<output_size) {
+    // Verify fragment checksums if present
+    uint64_t q=0;  // fragment start
+    unsigned nf=0;  // number of complete fragments
+    vector<const char*> fptr(b.size+1);  // fragments to hash
+    vector<int64_t> flen(b.size+1);  // fragment sizes
+    vector<char> fsha1(b.size*20+1);  // fragment hashes
+    assert(b.extracted==0);
+    for (unsigned j=b.start; j<b.start+b.size; ++j, ++nf) {
+      assert(j>0 && j<job.jd.ht.size());
+      assert(job.jd.ht[j].usize>=0);
+      assert(job.jd.ht[j].usize<=0x7fffffff);
+      if (q+job.jd.ht[j].usize>out.size()) break;
+      fptr[nf]=out.c_str()+q;
+      flen[nf]=job.jd.ht[j].usize;
+      q+=job.jd.ht[j].usize;
+    }
+    libzpaq::sha1Multi(nf, &fptr[0], &flen[0], &fsha1[0]);
+    for (unsigned j=b.start; j<b.start+b.size; ++j) {
+      if (j-b.start>=nf) error("Incomplete decompression");
+      const char* sha1result=&fsha1[(j-b.start)*20];
+      if (memcmp(sha1result, job.jd.ht[j].sha1, 20)) {
         lock(job.mutex);
         fflush(stdout);
-        fprintf(stderr, "output [%d..%d] %d of %d bytes\n",
-             b.start, b.start+b.size-1, int(out.size()), output_size);
+        fprintf(stderr, "Job %d: fragment %u size %d checksum failed\n",
+               jobNumber, j, job.jd.ht[j].usize);
         release(job.mutex);
-        error("unexpected end of compressed data");
-      }
-
-      // Verify fragment checksums if present
-      uint64_t q=0;  // fragment start
-      libzpaq::SHA1 sha1;
-      assert(b.extracted==0);
-      for (unsigned j=b.start; j<b.start+b.size; ++j) {
-        assert(j>0 && j<job.jd.ht.size());
-        assert(job.jd.ht[j].usize>=0);
-        assert(job.jd.ht[j].usize<=0x7fffffff);
-        if (q+job.jd.ht[j].usize>out.size())
-          error("Incomplete decompression");
-        char sha1result[20];
-        sha1.write(out.c_str()+q, job.jd.ht[j].usize);
-        memcpy(sha1result, sha1.result(), 20);
-        q+=job.jd.ht[j].usize;
-        if (memcmp(sha1result, job.jd.ht[j].sha1, 20)) {
-          lock(job.mutex);
-          fflush(stdout);
-          fprintf(stderr, "Job %d: fragment %u size %d checksum failed\n",
-                 jobNumber, j, job.jd.ht[j].usize);
-          release(job.mutex);
-          error("bad checksum");
-        }
-        ++b.extracted;
+        error("bad checksum");
       }
+      ++b.extracted;
     }
+  }
 
-    // If out of memory, let another thread try
-    catch (std::bad_alloc& e) {
-      lock(job.mutex);
-      fflush(stdout);
-      fprintf(stderr, "Job %d killed: %s\n", jobNumber, e.what());
-      b.state=Block::READY;
-      b.extracted=0;
-      out.resize(0);
-      release(job.mutex);
-      return 0;
-    }
+  // If out of memory, try again after the other blocks, but give up
+  // after as many failures as there are threads.
+  catch (std::bad_alloc& e) {
+    lock(job.mutex);
+    fflush(stdout);
+    fprintf(stderr, "Job %d killed: %s\n", jobNumber, e.what());
+    b.state=Block::READY;
+    b.extracted=0;
+    out.resize(0);
+    const bool retry=++job.killed<job.ex.size();
+    if (retry) b.state=Block::WORKING;
+    release(job.mutex);
+    if (retry) job.ex.submit(decompressTask, arg, -1.0);
+    return;
+  }
 
-    // Other errors: assume bad input
-    catch (std::exception& e) {
-      lock(job.mutex);
-      fflush(stdout);
-      fprintf(stderr, "Job %d: skipping [%u..%u] at %1.0f: %s\n",
-              jobNumber, b.start+b.extracted, b.start+b.size-1,
-              b.offset+0.0, e.what());
-      release(job.mutex);
-      continue;
-    }
-
-    // Write the files in dt that point to this block
-    lock(job.write_mutex);
-    for (unsigned ip=0; ip<b.files.size(); ++ip) {
-      DTMap::iterator p=b.files[ip];
-      if (p->second.date==0 || p->second.data<0
-          || p->second.data>=int64_t(p->second.ptr.size()))
-        continue;  // don't write
-
-      // Look for pointers to this block
-      const vector<unsigned>& ptr=p->second.ptr;
-      int64_t offset=0;  // write offset
-      for (unsigned j=0; j<ptr.size(); ++j) {
-        if (ptr[j]<b.start || ptr[j]>=b.start+b.extracted) {
-          offset+=job.jd.ht[ptr[j]].usize;
-          continue;
-        }
+  // Other errors: assume bad input
+  catch (std::exception& e) {
+    lock(job.mutex);
+    fflush(stdout);
+    fprintf(stderr, "Job %d: skipping [%u..%u] at %1.0f: %s\n",
+            jobNumber, b.start+b.extracted, b.start+b.size-1,
+            b.offset+0.0, e.what());
+    release(job.mutex);
+    return;
+  }
 
-        // Close last opened file if different
-        if (p!=job.lastdt) {
-          if (job.outf!=FPNULL) {
-            assert(job.lastdt!=job.jd.dt.end());
-            assert(job.lastdt->second.date);
-            assert(job.lastdt->second.data
-                   <int64_t(job.lastdt->second.ptr.size()));
-            fclose(job.outf);
-            job.outf=FPNULL;
-          }
-          job.lastdt=job.jd.dt.end();
+  // Write the files in dt that point to this block
+  lock(job.write_mutex);
+  for (unsigned ip=0; ip<b.files.size(); ++ip) {
+    DTMap::iterator p=b.files[ip];
+    if (p->second.date==0 || p->second.data<0
+        || p->second.data>=int64_t(p->second.ptr.size()))
+      continue;  // don't write
+
+    // Look for pointers to this block
+    const vector<unsigned>& ptr=p->second.ptr;
+    int64_t offset=0;  // write offset
+    for (unsigned j=0; j<ptr.size(); ++j) {
+      if (ptr[j]<b.start || ptr[j]>=b.start+b.extracted) {
+        offset+=job.jd.ht[ptr[j]].usize;
+        continue;
+      }
+
+      // Close last opened file if different
+      if (p!=job.lastdt) {
+        if (job.outf!=FPNULL) {
+          assert(job.lastdt!=job.jd.dt.end());
+          assert(job.lastdt->second.date);
+          assert(job.lastdt->second.data
+                 <int64_t(job.lastdt->second.ptr.size()));
+          fclose(job.outf);
+          job.outf=FPNULL;
         }
+        job.lastdt=job.jd.dt.end();
+      }
 
-        // Open file for output
-        if (job.lastdt==job.jd.dt.end()) {
-          string filename=job.jd.rename(p->first);
-          assert(job.outf==FPNULL);
-          if (p->second.data==0) {
-            if (!job.jd.dotest) makepath(filename);
+      // Open file for output
+      if (job.lastdt==job.jd.dt.end()) {
+        string filename=job.jd.rename(p->first);
+        assert(job.outf==FPNULL);
+        if (p->second.data==0) {
+          if (!job.jd.dotest) makepath(filename);
+          if (job.jd.summary<=0) {
+            lock(job.mutex);
+            print_progress(job.total_size, job.total_done, job.jd.summary);
             if (job.jd.summary<=0) {
+              printf("> ");
+              printUTF8(filename.c_str());
+              printf("\n");
+            }
+            release(job.mutex);
+          }
+          if (!job.jd.dotest) {
+            job.outf=fopen(filename.c_str(), WB);
+            if (job.outf==FPNULL) {
               lock(job.mutex);
-              print_progress(job.total_size, job.total_done, job.jd.summary);
-              if (job.jd.summary<=0) {
-                printf("> ");
-                printUTF8(filename.c_str());
-                printf("\n");
-              }
+              printerr(filename.c_str());
               release(job.mutex);
             }
-            if (!job.jd.dotest) {
-              job.outf=fopen(filename.c_str(), WB);
-              if (job.outf==FPNULL) {
-                lock(job.mutex);
-                printerr(filename.c_str());
-                release(job.mutex);
-              }
 #ifndef unix
-              else if ((p->second.attr&0x200ff)==0x20000+'w') {  // sparse?
-                DWORD br=0;
-                if (!DeviceIoControl(job.outf, FSCTL_SET_SPARSE,
-                    NULL, 0, NULL, 0, &br, NULL))  // set sparse attribute
-                  printerr(filename.c_str());
-              }
-#endif
+            else if ((p->second.attr&0x200ff)==0x20000+'w') {  // sparse?
+              DWORD br=0;
+              if (!DeviceIoControl(job.outf, FSCTL_SET_SPARSE,
+                  NULL, 0, NULL, 0, &br, NULL))  // set sparse attribute
+                printerr(filename.c_str());
             }
+#endif
           }
-          else if (!job.jd.dotest)
-            job.outf=fopen(filename.c_str(), RBPLUS);  // update existing file
-          if (!job.jd.dotest && job.outf==FPNULL) break;  // skip errors
-          job.lastdt=p;
-          assert(job.jd.dotest || job.outf!=FPNULL);
-        }
-        assert(job.lastdt==p);
-
-        // Find block offset of fragment
-        uint64_t q=0;  // fragment offset from start of block
-        for (unsigned k=b.start; k<ptr[j]; ++k) {
-          assert(k>0);
-          assert(k<job.jd.ht.size());
-          if (job.jd.ht[k].usize<0) error("streaming fragment in file");
-          assert(job.jd.ht[k].usize>=0);
-          q+=job.jd.ht[k].usize;
         }
-        assert(q+job.jd.ht[ptr[j]].usize<=out.size());
+        else if (!job.jd.dotest)
+          job.outf=fopen(filename.c_str(), RBPLUS);  // update existing file
+        if (!job.jd.dotest && job.outf==FPNULL) break;  // skip errors
+        job.lastdt=p;
+        assert(job.jd.dotest || job.outf!=FPNULL);
+      }
+      assert(job.lastdt==p);
+
+      // Find block offset of fragment
+      uint64_t q=0;  // fragment offset from start of block
+      for (unsigned k=b.start; k<ptr[j]; ++k) {
+        assert(k>0);
+        assert(k<job.jd.ht.size());
+        if (job.jd.ht[k].usize<0) error("streaming fragment in file");
+        assert(job.jd.ht[k].usize>=0);
+        q+=job.jd.ht[k].usize;
+      }
+      assert(q+job.jd.ht[ptr[j]].usize<=out.size());
 
-        // Combine consecutive fragments into a single write
-        assert(offset>=0);
+      // Combine consecutive fragments into a single write
+      assert(offset>=0);
+      ++p->second.data;
+      uint64_t usize=job.jd.ht[ptr[j]].usize;
+      assert(usize<=0x7fffffff);
+      assert(b.start+b.size<=job.jd.ht.size());
+      while (j+1<ptr.size() && ptr[j+1]==ptr[j]+1
+             && ptr[j+1]<b.start+b.size
+             && job.jd.ht[ptr[j+1]].usize>=0
+             && usize+job.jd.ht[ptr[j+1]].usize<=0x7fffffff) {
         ++p->second.data;
-        uint64_t usize=job.jd.ht[ptr[j]].usize;
-        assert(usize<=0x7fffffff);
-        assert(b.start+b.size<=job.jd.ht.size());
-        while (j+1<ptr.size() && ptr[j+1]==ptr[j]+1
-               && ptr[j+1]<b.start+b.size
-               && job.jd.ht[ptr[j+1]].usize>=0
-               && usize+job.jd.ht[ptr[j+1]].usize<=0x7fffffff) {
-          ++p->second.data;
-          assert(p->second.data<=int64_t(ptr.size()));
-          assert(job.jd.ht[ptr[j+1]].usize>=0);
-          usize+=job.jd.ht[ptr[++j]].usize;
-        }
-        assert(usize<=0x7fffffff);
-        assert(q+usize<=out.size());
-
-        // Write the merged fragment unless they are all zeros and it
-        // does not include the last fragment.
-        uint64_t nz=q;  // first nonzero byte in fragments to be written
-        while (nz<q+usize && out.c_str()[nz]==0) ++nz;
-        if (!job.jd.dotest && (nz<q+usize || j+1==ptr.size())) {
-          fseeko(job.outf, offset, SEEK_SET);
-          fwrite(out.c_str()+q, 1, usize, job.outf);
-        }
-        offset+=usize;
-        lock(job.mutex);
-        job.total_done+=usize;
-        release(job.mutex);
+        assert(p->second.data<=int64_t(ptr.size()));
+        assert(job.jd.ht[ptr[j+1]].usize>=0);
+        usize+=job.jd.ht[ptr[++j]].usize;
+      }
+      assert(usize<=0x7fffffff);
+      assert(q+usize<=out.size());
+
+      // Write the merged fragment unless they are all zeros and it
+      // does not include the last fragment.
+      uint64_t nz=q;  // first nonzero byte in fragments to be written
+      while (nz<q+usize && out.c_str()[nz]==0) ++nz;
+      if (!job.jd.dotest && (nz<q+usize || j+1==ptr.size())) {
+        fseeko(job.outf, offset, SEEK_SET);
+        fwrite(out.c_str()+q, 1, usize, job.outf);
+      }
+      offset+=usize;
+      lock(job.mutex);
+      job.total_done+=usize;
+      release(job.mutex);
 
-        // Close file. If this is the last fragment then set date and attr.
-        // Do not set read-only attribute in Windows yet.
-        if (p->second.data==int64_t(ptr.size())) {
-          assert(p->second.date);
-          assert(job.lastdt!=job.jd.dt.end());
-          assert(job.jd.dotest || job.outf!=FPNULL);
-          if (!job.jd.dotest) {
-            assert(job.outf!=FPNULL);
-            string fn=job.jd.rename(p->first);
-            int64_t attr=p->second.attr;
-            int64_t date=p->second.date;
-            if ((p->second.attr&0x1ff)=='w'+256) attr=0;  // read-only?
-            if (p->second.data!=int64_t(p->second.ptr.size()))
-              date=attr=0;  // not last frag
-            close(fn.c_str(), date, attr, job.outf);
-            job.outf=FPNULL;
-          }
-          job.lastdt=job.jd.dt.end();
+      // Close file. If this is the last fragment then set date and attr.
+      // Do not set read-only attribute in Windows yet.
+      if (p->second.data==int64_t(ptr.size())) {
+        assert(p->second.date);
+        assert(job.lastdt!=job.jd.dt.end());
+        assert(job.jd.dotest || job.outf!=FPNULL);
+        if (!job.jd.dotest) {
+          assert(job.outf!=FPNULL);
+          string fn=job.jd.rename(p->first);
+          int64_t attr=p->second.attr;
+          int64_t date=p->second.date;
+          if ((p->second.attr&0x1ff)=='w'+256) attr=0;  // read-only?
+          if (p->second.data!=int64_t(p->second.ptr.size()))
+            date=attr=0;  // not last frag
+          close(fn.c_str(), date, attr, job.outf);
+          job.outf=FPNULL;
         }
-      } // end for j
-    } // end for ip
-
-    // Last file
-    release(job.write_mutex);
-  } // end while true
+        job.lastdt=job.jd.dt.end();
+      }
+    } // end for j
+  } // end for ip
 
-  // Last block
-  return 0;
+  // Last file
+  release(job.write_mutex);
 }
 
 // Streaming output destination
@@ -3196,7 +4188,7 @@ int Jidac::extract() {
   // Label files to extract with data=0.
   // Skip existing output files. If force then skip only if equal
   // and set date and attributes.
-  ExtractJob job(*this);
+  ExtractJob job(*this, *executor);
   int total_files=0, skipped=0;
   for (DTMap::iterator p=dt.begin(); p!=dt.end(); ++p) {
     p->second.data=-1;  // skip
@@ -3368,8 +4360,16 @@ int Jidac::extract() {
   // Decompress archive in parallel
   printf("Extracting %1.6f MB in %d files -threads %d\n",
       job.total_size/1000000.0, total_files, threads);
-  vector<ThreadID> tid(threads);
-  for (unsigned i=0; i<tid.size(); ++i) run(tid[i], decompressThread, &job);
+  job.task.resize(block.size());
+  for (unsigned i=0; i<block.size(); ++i) {
+    Block& b=block[i];
+    job.task[i].job=&job;
+    job.task[i].k=i;
+    if (b.state==Block::READY && b.size>0 && b.usize>=0) {
+      b.state=Block::WORKING;
+      executor->submit(decompressTask, &job.task[i], double(b.usize));
+    }
+  }
 
   // Extract streaming files
   unsigned segments=0;  // count
@@ -3458,8 +4458,8 @@ int Jidac::extract() {
   }
   if (segments>0) printf("%u streaming segments extracted\n", segments);
 
-  // Wait for threads to finish
-  for (unsigned i=0; i<tid.size(); ++i) join(tid[i]);
+  // Wait for blocks to finish
+  executor->wait();
 
   // Create empty directories and set file dates and attributes
   if (!dotest) {
@@ -3499,7 +4499,7 @@ int Jidac::extract() {
         "\nExtracted %u of %u files OK (%u errors)"
         " using %1.3f MB x %d threads\n",
         extracted-errors, extracted, errors, job.maxMemory/1000000,
-        int(tid.size()));
+        executor->size());
   }
   return errors>0;
 }